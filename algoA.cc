@@ -5,10 +5,18 @@
  * A* algorithm.
  */ 
 
+#include <sys/resource.h>
 #include "vqats.hh"
 #include "dtable.hh"
+#include "pool.hh"
 #include "fib.h"
 
+// Macros from http://en.wikipedia.org/wiki/C_preprocessor to prevent side effects
+#define min(a,b) \
+       ({ typeof (a) _a = (a); \
+           typeof (b) _b = (b); \
+         _a < _b ? _a : _b; })
+
 enum state_t
 {
     NONE = 0,
@@ -18,13 +26,29 @@ enum state_t
 
 struct QueueElement
 {
-    QueueElement(frame_t i1, frame_t i2): _i1(i1), _i2(i2), _estimate(0), _sum(0), _length(0) { }
+    QueueElement(frame_t i1, frame_t i2): _i1(i1), _i2(i2), _estimate(0), _sum(0), _length(0), _lazy(false) { }
     frame_t _i1, _i2;
     score_t _estimate; // estimated score
     score_t _sum; // cumulative score
-    uint16_t _length; // path length
+    uint32_t _length; // path length
+    bool _lazy; // diagonal move not scored yet: _sum is that of the node it leaves, _estimate uses a bound of
+                // the move's cost, and no node refers to it
 };
 
+struct NodeData
+{
+    NodeData(): _he(NULL), _qe(NULL), _state(NONE) { }
+    void* _he; // heap element
+    QueueElement* _qe; // queue element
+    state_t _state; // node state
+};
+
+// cost of going from (i1, i2) to (j1, j2) by deleting and inserting frames only
+static inline score_t straight_cost(frame_t i1, frame_t i2, frame_t j1, frame_t j2)
+{
+    return (j1 - i1) * (1.0 - DELETED_FRAME) + (j2 - i2) * (1.0 - INSERTED_FRAME);
+}
+
 static inline int element_comparator(void* x, void* y)
 {
     QueueElement* a = (QueueElement*)x;
@@ -36,34 +60,106 @@ static inline int element_comparator(void* x, void* y)
 
 static inline score_t element_heuristic(frame_t i1, frame_t i2, frame_t j1, frame_t j2)
 {
-    frame_t a1 = abs(i1 - j1);
-    frame_t a2 = abs(i2 - j2);
+    frame_t a1 = i1 > j1 ? i1 - j1 : j1 - i1;
+    frame_t a2 = i2 > j2 ? i2 - j2 : j2 - i2;
     if (a1 > a2) return (a1 - a2) * (1.0 - DELETED_FRAME);
     else return (a2 - a1) * (1.0 - INSERTED_FRAME);
 }
 
-score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2)
+// records a path to a node: opens the node, or updates it if the path is cheaper (reopening it if anytime)
+static void push_node(SparseTable<NodeData>& start_nodes, NodeData* node, struct fibheap* start_heap,
+                      Pool<QueueElement>& pool, QueueElement* qe, bool anytime)
+{
+    frame_t i1 = qe->_i1, i2 = qe->_i2;
+    if (node == NULL)
+        node = &start_nodes.insert(i1, i2);
+    switch (node->_state)
+    {
+    case NONE:
+#ifdef DEBUG
+        printf("expanding start: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qe->_estimate, qe->_sum, qe->_length);
+#endif
+#ifdef FH_STATS
+        {
+            long ninserts = fh_ninserts(start_heap);
+            if (ninserts % 10000 == 0) { printf("%ld %ld %ld\n", ninserts, fh_nextracts(start_heap), fh_maxn(start_heap)); fflush(stdout); }
+        }
+#endif
+        assert(node->_qe == NULL);
+        node->_he = fh_insert(start_heap, (void*)qe);
+        node->_qe = qe;
+        node->_state = OPEN;
+        break;
+    case OPEN:
+#ifdef DEBUG
+        printf("updating start: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qe->_estimate, qe->_sum, qe->_length);
+#endif
+        assert(node->_qe != NULL);
+        if (qe->_estimate < node->_qe->_estimate)
+        {
+            node->_qe = qe;
+            qe = (QueueElement*)fh_replacedata(start_heap, (struct fibheap_el*)node->_he, (void*)qe);
+        }
+        pool.free(qe);
+        break;
+    case CLOSED:
+        if (anytime && qe->_sum < node->_qe->_sum) // only anytime search reopens nodes
+        {
+#ifdef DEBUG
+            printf("reopening start: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qe->_estimate, qe->_sum, qe->_length);
+#endif
+            pool.free(node->_qe);
+            node->_he = fh_insert(start_heap, (void*)qe);
+            node->_qe = qe;
+            node->_state = OPEN;
+        }
+        else
+            pool.free(qe);
+        break;
+    default:
+        assert(false); // should not reach here
+        break;
+    }
+}
+
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options, SearchResult* result)
 {
     frame_t n1 = v._video_map[video1]._frames.size();
     frame_t n2 = v._video_map[video2]._frames.size();    
-    void*** start_he = new_table<void*>(n1 + 1, n2 + 1, NULL); // heap elements
-    QueueElement*** start_qe = new_table<QueueElement*>(n1 + 1, n2 + 1, NULL); // queue elements
-    state_t** start_state = new_table<state_t>(n1 + 1, n2 + 1, NONE); // node states
+    SparseTable<NodeData> start_nodes; // only nodes that have been generated are stored
+    Pool<QueueElement> pool; // queue elements, released in bulk when the search ends
 
     // initial values
-    start_qe[0][0] = new QueueElement(0, 0);
-    start_state[0][0] = OPEN;
+    NodeData& start = start_nodes.insert(0, 0);
+    start._qe = new (pool.alloc()) QueueElement(0, 0);
+    start._state = OPEN;
     
     // initial queues
     struct fibheap* start_heap = fh_makeheap();
     fh_setcmp(start_heap, element_comparator);
-    start_he[0][0] = fh_insert(start_heap, (void*)start_qe[0][0]);
+    start._he = fh_insert(start_heap, (void*)start._qe);
 
-    score_t sum = 0;
-    uint16_t length = 0;
-    int ninserts = 0;
+    score_t weight = 1.0 + options._epsilon; // inflates the heuristic for weighted A*
+    // anytime mode: keep searching after the first path, pruning with the best path so far (the incumbent)
+    // and reopening nodes when a cheaper path to them is found, until the queue runs dry or time is up.
+    bool anytime = options._deadline > 0;
+    double deadline = wall_time() + options._deadline;
+    bool timed_out = false;
+    // the incumbent starts as the path that deletes and inserts every frame
+    score_t sum = straight_cost(0, 0, n1, n2);
+    uint32_t length = n1 + n2;
+    unsigned long expansions = 0;
+    // lazy mode: diagonal moves are queued with a cheap lower bound of their cost, and scored when they reach
+    // the top of the queue. moves whose bound is already too costly are never scored, and the search stays
+    // optimal (or within the weight).
+    // anytime search needs every open path in the node table for its bounds, so it scores eagerly.
+    bool lazy = options._lazy && !anytime;
 #ifdef FH_STATS
-    printf("maxinserts = %d\n", (n1+1)*(n2+1)); fflush(stdout);
+    if (!options._quiet)
+    {
+        printf("maxinserts = %lu\n", (unsigned long)(n1+1)*(n2+1)); fflush(stdout);
+    }
 #endif
 
     while (true)
@@ -72,20 +168,56 @@ score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& vide
         int i1, i2;
         score_t s;
 
+        if (anytime && (expansions & 63) == 0 && wall_time() > deadline)
+        {
+            timed_out = true;
+            break;
+        }
+
         // check start frontier
         qs = (QueueElement*)fh_extractmin(start_heap);
-        assert(qs); // there is always a path
-        assert(start_state[qs->_i1][qs->_i2] == OPEN); // this node should be open
+        if (qs == NULL)
+        {
+            assert(anytime); // there is always a path, so only an anytime search can run dry
+            break;
+        }
+        NodeData* node = start_nodes.find(qs->_i1, qs->_i2);
+        if (qs->_lazy)
+        {
+            // score the diagonal move now that it is the best candidate, and queue it with its true cost
+            if (node != NULL && node->_state == CLOSED)
+            {
+                pool.free(qs); // a path at least as cheap has been expanded already
+                continue;
+            }
+#ifdef DEBUG
+            printf("scoring start: (%d,%d) est=%.4f sum=%.4f len=%d\n", qs->_i1, qs->_i2, qs->_estimate, qs->_sum, qs->_length);
+#endif
+            qs->_lazy = false;
+            qs->_sum += 1.0 - v.compute_frame_score(video1, video2, qs->_i1 - 1, qs->_i2 - 1);
+            qs->_estimate = qs->_sum + weight * element_heuristic(qs->_i1, qs->_i2, n1, n2);
+            push_node(start_nodes, node, start_heap, pool, qs, anytime);
+            continue;
+        }
+        assert(node && node->_state == OPEN); // this node should be open
 #ifdef DEBUG
         printf("extract from start: (%d,%d) est=%.4f sum=%.4f len=%d\n", qs->_i1, qs->_i2, qs->_estimate, qs->_sum, qs->_length);
 #endif
-        start_state[qs->_i1][qs->_i2] = CLOSED;
-        if (qs->_i1 == n1 && qs->_i2 == n2) // we have found an optimal path
+        node->_state = CLOSED;
+        if (qs->_i1 == n1 && qs->_i2 == n2) // we have found an optimal path (within the weight, if weighted)
         {
-            sum = qs->_sum;
-            length = qs->_length;
-            break;
+            if (!anytime || qs->_sum < sum)
+            {
+                sum = qs->_sum;
+                length = qs->_length;
+            }
+            if (!anytime)
+                break;
+            continue;
         }
+        if (anytime && qs->_sum + element_heuristic(qs->_i1, qs->_i2, n1, n2) >= sum)
+            continue; // cannot improve on the incumbent
+        expansions++;
         // expand this node outward
         for (int dir = 0; dir < 3; dir++)
         {
@@ -95,78 +227,98 @@ score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& vide
             case 1: i1 = qs->_i1; i2 = qs->_i2 + 1; break; // insert frame
             case 2: i1 = qs->_i1 + 1; i2 = qs->_i2; break; // delete frame
             }
-            if (i1 <= n1 && i2 <= n2 && start_state[i1][i2] != CLOSED)
+            if (i1 > (int)n1 || i2 > (int)n2)
+                continue;
+            node = start_nodes.find(i1, i2);
+            if (node == NULL || node->_state != CLOSED || anytime)
             {
+                qe = new (pool.alloc()) QueueElement(i1, i2);
+                if (dir == 0 && lazy)
+                {
+                    // queue the diagonal move with a lower bound of its cost, and leave the node alone until it is scored
+                    qe->_sum = qs->_sum;
+                    qe->_length = qs->_length + 1;
+                    qe->_estimate = qe->_sum + 1.0 - v.bound_frame_score(video1, video2, i1 - 1, i2 - 1) +
+                        weight * element_heuristic(i1, i2, n1, n2);
+                    qe->_lazy = true;
+                    fh_insert(start_heap, (void*)qe);
+                    continue;
+                }
                 switch (dir)
                 {
-                case 0: s = 1.0 - v.compute_frame_score(video1, video2, i1 - 1, i2 - 1); break;
+                case 0: // a match that cannot improve on the incumbent is given up as soon as that is certain
+                    s = 1.0 - v.compute_frame_score(video1, video2, i1 - 1, i2 - 1,
+                                                    anytime ? 1.0 - (sum - qs->_sum - element_heuristic(i1, i2, n1, n2)) : -INF);
+                    break;
                 case 1: s = 1.0 - INSERTED_FRAME; break;
                 case 2: s = 1.0 - DELETED_FRAME; break;
                 }
-                qe = new QueueElement(i1, i2);
                 qe->_sum = qs->_sum + s;
                 qe->_length = qs->_length + 1;
-                qe->_estimate = qe->_sum + element_heuristic(i1, i2, n1, n2);
-                switch (start_state[i1][i2])
+                qe->_estimate = qe->_sum + weight * element_heuristic(i1, i2, n1, n2);
+                if (anytime && qe->_sum + element_heuristic(i1, i2, n1, n2) >= sum)
                 {
-                case NONE:
-#ifdef DEBUG
-                    printf("expanding start: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qe->_estimate, qe->_sum, qe->_length);
-#endif
-#ifdef FH_STATS
-                    ninserts = fh_ninserts(start_heap);
-                    if (ninserts % 10000 == 0) { printf("%d %d %d\n", ninserts, fh_nextracts(start_heap), fh_maxn(start_heap)); fflush(stdout); }
-#endif
-                    assert(start_qe[i1][i2] == NULL);
-                    start_he[i1][i2] = fh_insert(start_heap, (void*)qe);
-                    start_qe[i1][i2] = qe;
-                    start_state[i1][i2] = OPEN;
-                    break;
-                case OPEN:
-#ifdef DEBUG
-                    printf("updating start: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qe->_estimate, qe->_sum, qe->_length);
-#endif
-                    assert(start_qe[i1][i2] != NULL);
-                    if (qe->_estimate < start_qe[i1][i2]->_estimate)
-                    {
-                        start_qe[i1][i2] = qe;
-                        qe = (QueueElement*)fh_replacedata(start_heap, (struct fibheap_el*)start_he[i1][i2], (void*)qe);
-                    }
-                    delete qe;
-                    break;
-                default:
-                    assert(false); // should not reach here
-                    break;
+                    pool.free(qe); // cannot improve on the incumbent
+                    continue;
                 }
+                push_node(start_nodes, node, start_heap, pool, qe, anytime);
             }
         }
     }
     assert(length > 0);
 
+    // proven lower bound on the cost of an optimal path
+    score_t lower = anytime ? sum : sum / weight;
+    if (timed_out)
+    {
+        // some open node lies on an optimal path with its optimal cumulative score, unless the
+        // incumbent is already optimal. completing each open node with inserts and deletes also
+        // gives a path, which may improve on the incumbent.
+        for (size_t k = 0; k < start_nodes.capacity(); k++)
+        {
+            if (!start_nodes.used(k) || start_nodes.value(k)._state != OPEN)
+                continue;
+            QueueElement* qe = start_nodes.value(k)._qe;
+            lower = min(lower, qe->_sum + element_heuristic(qe->_i1, qe->_i2, n1, n2));
+            score_t completed = qe->_sum + straight_cost(qe->_i1, qe->_i2, n1, n2);
+            if (completed < sum)
+            {
+                sum = completed;
+                length = qe->_length + (n1 - qe->_i1) + (n2 - qe->_i2);
+            }
+        }
+        lower = min(lower, sum);
+    }
+
 #ifdef DEBUG
     printf("Sum = %f\n", sum);
     printf("Length = %d\n", length);
 #endif
 #ifdef FH_STATS
-    printf("MaxN = %d\n", fh_maxn(start_heap));
-    printf("Inserts = %d\n", fh_ninserts(start_heap));
-    printf("Extracts = %d\n", fh_nextracts(start_heap));
+    if (!options._quiet)
+    {
+        printf("MaxN = %ld\n", fh_maxn(start_heap));
+        printf("Inserts = %ld\n", fh_ninserts(start_heap));
+        printf("Extracts = %ld\n", fh_nextracts(start_heap));
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("Nodes = %lu\n", (unsigned long)start_nodes.size());
+        printf("SearchMemory = %lu KB\n", (unsigned long)((start_nodes.bytes() + pool.bytes()) / 1024));
+        printf("PeakMemory = %ld KB\n", usage.ru_maxrss);
+    }
 #endif
     fflush(stdout);
 
     // clean up
     fh_deleteheap(start_heap);
-    for (uint16_t i1 = 0; i1 <= n1; i1++)
+
+    if (result)
     {
-        for (uint16_t i2 = 0; i2 <= n2; i2++)
-        {
-            if (start_qe[i1][i2])
-                delete start_qe[i1][i2];
-        }
+        // the heuristic is consistent, so weighted A* without reopening finds a path within the weight of optimal
+        result->set(sum, lower, length, n1, n2);
+        result->_expansions = expansions;
+        result->_timed_out = timed_out;
     }
-    delete_table(start_he, n1 + 1, n2 + 1);
-    delete_table(start_qe, n1 + 1, n2 + 1);
-    delete_table(start_state, n1 + 1, n2 + 1);
 
     return 1.0 - sum / length;
 }
@@ -5,8 +5,10 @@
  * Bidirectional A* algorithm.
  */ 
 
+#include <sys/resource.h>
 #include "vqats.hh"
 #include "dtable.hh"
+#include "pool.hh"
 #include "fib.h"
 
 // Macros from http://en.wikipedia.org/wiki/C_preprocessor to prevent side effects
@@ -19,9 +21,6 @@
            typeof (b) _b = (b); \
          _a > _b ? _a : _b; })
 
-typedef std::pair<frame_t, frame_t> coord_t;
-typedef std::set<coord_t> FrontierSet;
-
 enum state_t
 {
     NONE = 0,
@@ -35,7 +34,86 @@ struct QueueElement
     frame_t _i1, _i2;
     score_t _estimate; // estimated score
     score_t _sum; // cumulative score
-    uint16_t _length; // path length
+    uint32_t _length; // path length
+};
+
+struct NodeData
+{
+    NodeData(): _he(NULL), _qe(NULL), _state(NONE) { }
+    void* _he; // heap element
+    QueueElement* _qe; // queue element
+    state_t _state; // node state
+};
+
+typedef SparseTable<NodeData> NodeTable;
+
+// Index over the open nodes of one search direction, answering the minimum of
+// element_heuristic + cumulative score over the whole frontier in logarithmic time.
+// The heuristic between two nodes only depends on their diagonal offsets d = i1 - i2:
+// it is (e - d) * w_up when the frontier node is at a larger offset e, and
+// (d - e) * w_down otherwise. We therefore keep the best cumulative score for each
+// offset, and two min segment trees over offsets holding g + w_up * e and g - w_down * e.
+class FrontierIndex
+{
+public:
+    FrontierIndex(frame_t n1, frame_t n2, score_t w_up, score_t w_down)
+        : _base(n2), _w_up(w_up), _w_down(w_down), _sums(n1 + n2 + 1)
+    {
+        for (_size = 1; _size < (int)_sums.size(); _size <<= 1);
+        _up.assign(2 * _size, INF);
+        _down.assign(2 * _size, INF);
+    }
+
+    void insert(int d, score_t sum)
+    {
+        _sums[d + _base].insert(sum);
+        refresh(d);
+    }
+
+    void erase(int d, score_t sum)
+    {
+        std::multiset<score_t>& sums = _sums[d + _base];
+        sums.erase(sums.find(sum));
+        refresh(d);
+    }
+
+    // min over frontier nodes at offset e of heuristic(d, e) + cumulative score
+    score_t query(int d) const
+    {
+        score_t up = range_min(_up, d + _base, _sums.size() - 1) - _w_up * d;
+        score_t down = range_min(_down, 0, d + _base) + _w_down * d;
+        return min(up, down);
+    }
+
+private:
+    void refresh(int d)
+    {
+        const std::multiset<score_t>& sums = _sums[d + _base];
+        int k = d + _base + _size;
+        _up[k] = sums.empty() ? INF : *sums.begin() + _w_up * d;
+        _down[k] = sums.empty() ? INF : *sums.begin() - _w_down * d;
+        for (k >>= 1; k > 0; k >>= 1)
+        {
+            _up[k] = min(_up[2 * k], _up[2 * k + 1]);
+            _down[k] = min(_down[2 * k], _down[2 * k + 1]);
+        }
+    }
+
+    score_t range_min(const std::vector<score_t>& tree, int lo, int hi) const
+    {
+        score_t best = INF;
+        for (lo += _size, hi += _size + 1; lo < hi; lo >>= 1, hi >>= 1)
+        {
+            if (lo & 1) best = min(best, tree[lo++]);
+            if (hi & 1) best = min(best, tree[--hi]);
+        }
+        return best;
+    }
+
+    int _base, _size; // offsets are stored at d + _base, leaves start at _size
+    score_t _w_up, _w_down;
+    std::vector<std::multiset<score_t> > _sums; // cumulative scores of open nodes, by offset
+    std::vector<score_t> _up, _down; // segment trees
 };
 
 static inline int element_comparator(void* x, void* y)
@@ -49,45 +127,57 @@ static inline int element_comparator(void* x, void* y)
 
 static inline score_t element_heuristic(frame_t i1, frame_t i2, frame_t j1, frame_t j2)
 {
-    frame_t a1 = abs(i1 - j1);
-    frame_t a2 = abs(i2 - j2);
+    frame_t a1 = i1 > j1 ? i1 - j1 : j1 - i1;
+    frame_t a2 = i2 > j2 ? i2 - j2 : j2 - i2;
     if (a1 > a2) return (a1 - a2) * (1.0 - DELETED_FRAME);
     else return (a2 - a1) * (1.0 - INSERTED_FRAME);
 }
 
-score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2)
+// smallest score of a match worth computing exactly: a match scoring less would make every path through it cost
+// more than the best path found so far, given the cost of the path up to it and a lower bound on the rest
+static inline score_t cutoff(score_t sum, score_t path_sum, score_t rest)
+{
+    return sum < INF ? 1.0 - (sum - path_sum - rest) : -INF;
+}
+
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options, SearchResult* result)
 {
     frame_t n1 = v._video_map[video1]._frames.size();
     frame_t n2 = v._video_map[video2]._frames.size();    
-    void*** start_he = new_table<void*>(n1 + 1, n2 + 1, NULL); // heap elements
-    void*** end_he = new_table<void*>(n1 + 1, n2 + 1, NULL); // heap elements
-    QueueElement*** start_qe = new_table<QueueElement*>(n1 + 1, n2 + 1, NULL); // queue elements
-    QueueElement*** end_qe = new_table<QueueElement*>(n1 + 1, n2 + 1, NULL); // queue elements
-    state_t** start_state = new_table<state_t>(n1 + 1, n2 + 1, NONE); // node states
-    state_t** end_state = new_table<state_t>(n1 + 1, n2 + 1, NONE); // node states
+    NodeTable start_nodes, end_nodes; // only nodes that have been generated are stored
+    Pool<QueueElement> pool; // queue elements of both directions, released in bulk when the search ends
 
-    // frontiers
-    FrontierSet start_frontier;
-    FrontierSet end_frontier;
-    start_frontier.insert(coord_t(0, 0));
-    end_frontier.insert(coord_t(n1, n2));
+    // frontiers. going forward, a larger offset means frames to delete; going backward, frames to insert
+    FrontierIndex start_frontier(n1, n2, 1.0 - INSERTED_FRAME, 1.0 - DELETED_FRAME);
+    FrontierIndex end_frontier(n1, n2, 1.0 - DELETED_FRAME, 1.0 - INSERTED_FRAME);
+    start_frontier.insert(0, 0);
+    end_frontier.insert(n1 - n2, 0);
 
     // initial values
-    start_qe[0][0] = new QueueElement(0, 0);
-    end_qe[n1][n2] = new QueueElement(n1, n2);
-    start_state[0][0] = OPEN;
-    end_state[n1][n2] = OPEN;
+    NodeData& start = start_nodes.insert(0, 0);
+    NodeData& end = end_nodes.insert(n1, n2);
+    start._qe = new (pool.alloc()) QueueElement(0, 0);
+    end._qe = new (pool.alloc()) QueueElement(n1, n2);
+    start._state = OPEN;
+    end._state = OPEN;
     
     // initial queues
     struct fibheap* start_heap = fh_makeheap();
     struct fibheap* end_heap = fh_makeheap();
     fh_setcmp(start_heap, element_comparator);
     fh_setcmp(end_heap, element_comparator);
-    start_he[0][0] = fh_insert(start_heap, (void*)start_qe[0][0]);
-    end_he[n1][n2] = fh_insert(end_heap, (void*)end_qe[n1][n2]);
+    start._he = fh_insert(start_heap, (void*)start._qe);
+    end._he = fh_insert(end_heap, (void*)end._qe);
 
+    score_t weight = 1.0 + options._epsilon; // inflates the heuristic for weighted search
+    // once the frontiers meet, moves that cannot improve on the best path found so far are dropped, and their
+    // frame scores given up early. a weighted search may close nodes at more than their optimal cost, which
+    // then no longer bounds the rest of a path, so it does not prune.
+    bool prune = options._epsilon == 0;
     score_t sum = INF;
-    uint16_t length = 0;
+    uint32_t length = 0;
+    unsigned long expansions = 0;
 
     while (true)
     {
@@ -98,15 +188,18 @@ score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& vide
         // check start frontier
         qs = (QueueElement*)fh_extractmin(start_heap);
         assert(qs); // there is always a path
-        assert(start_state[qs->_i1][qs->_i2] == OPEN); // this node should be open
+        NodeData* node = start_nodes.find(qs->_i1, qs->_i2);
+        NodeData* other = end_nodes.find(qs->_i1, qs->_i2);
+        assert(node && node->_state == OPEN); // this node should be open
 #ifdef DEBUG
         printf("extract from start: (%d,%d) est=%.4f sum=%.4f len=%d\n", qs->_i1, qs->_i2, qs->_estimate, qs->_sum, qs->_length);
 #endif
-        start_state[qs->_i1][qs->_i2] = CLOSED;
-        start_frontier.erase(coord_t(qs->_i1, qs->_i2));
-        if (end_state[qs->_i1][qs->_i2] == CLOSED) // we have found a path, might not be optimal
+        node->_state = CLOSED;
+        expansions++;
+        start_frontier.erase(qs->_i1 - qs->_i2, qs->_sum);
+        if (other && other->_state == CLOSED) // we have found a path, might not be optimal
         {
-            qe = end_qe[qs->_i1][qs->_i2];
+            qe = other->_qe;
             if (qs->_sum + qe->_sum < sum)
             {
                 sum = qs->_sum + qe->_sum;
@@ -124,59 +217,61 @@ score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& vide
             case 1: i1 = qs->_i1; i2 = qs->_i2 + 1; break; // insert frame
             case 2: i1 = qs->_i1 + 1; i2 = qs->_i2; break; // delete frame
             }
-            if (i1 <= n1 && i2 <= n2 && start_state[i1][i2] != CLOSED)
+            if (i1 > (int)n1 || i2 > (int)n2)
+                continue;
+            node = start_nodes.find(i1, i2);
+            if (node == NULL || node->_state != CLOSED)
             {
+                // compute heuristic based on other frontier
+                score_t best_heuristic = element_heuristic(i1, i2, n1, n2);
+                other = end_nodes.find(i1, i2);
+                if (other && other->_state == CLOSED)
+                    best_heuristic = other->_qe->_sum;
+                else
+                    best_heuristic = min(best_heuristic, end_frontier.query(i1 - i2));
+#ifdef DEBUG
+                printf("best heuristic for (%d,%d) is %.4f\n", i1, i2, best_heuristic);
+#endif
+                score_t least = prune ? cutoff(sum, qs->_sum, best_heuristic) : -INF;
                 switch (dir)
                 {
-                case 0: s = 1.0 - v.compute_frame_score(video1, video2, i1 - 1, i2 - 1); break;
+                case 0: s = 1.0 - v.compute_frame_score(video1, video2, i1 - 1, i2 - 1, least); break;
                 case 1: s = 1.0 - INSERTED_FRAME; break;
                 case 2: s = 1.0 - DELETED_FRAME; break;
                 }
-                qe = new QueueElement(i1, i2);
+                if (1.0 - s < least)
+                    continue; // cannot improve on the best path found so far
+                qe = new (pool.alloc()) QueueElement(i1, i2);
                 qe->_sum = qs->_sum + s;
                 qe->_length = qs->_length + 1;
-                // compute heuristic based on other frontier
-                score_t best_heuristic = element_heuristic(i1, i2, n1, n2), h = 0;
-                if (end_state[i1][i2] == CLOSED)
-                {
-                    best_heuristic = end_qe[i1][i2]->_sum;
-                }
-                else
-                {
-                    for (FrontierSet::const_iterator it = end_frontier.begin(); it != end_frontier.end(); ++it)
-                    {
-                        h = element_heuristic(i1, i2, it->first, it->second) + end_qe[it->first][it->second]->_sum;
-                        best_heuristic = min(best_heuristic, h);
-                    }
-                }
-#ifdef DEBUG
-                printf("best heuristic for (%d,%d) is %.4f\n", i1, i2, best_heuristic);
-#endif
-                qe->_estimate = qe->_sum + best_heuristic;
-                // extend frontier
-                start_frontier.insert(coord_t(i1, i2));
-                switch (start_state[i1][i2])
+                qe->_estimate = qe->_sum + weight * best_heuristic;
+                if (node == NULL)
+                    node = &start_nodes.insert(i1, i2);
+                switch (node->_state)
                 {
                 case NONE:
 #ifdef DEBUG
                     printf("expanding start: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qe->_estimate, qe->_sum, qe->_length);
 #endif
-                    assert(start_qe[i1][i2] == NULL);
-                    start_he[i1][i2] = fh_insert(start_heap, (void*)qe);
-                    start_qe[i1][i2] = qe;
-                    start_state[i1][i2] = OPEN;
+                    assert(node->_qe == NULL);
+                    node->_he = fh_insert(start_heap, (void*)qe);
+                    node->_qe = qe;
+                    node->_state = OPEN;
+                    start_frontier.insert(i1 - i2, qe->_sum); // extend frontier
                     break;
                 case OPEN:
 #ifdef DEBUG
                     printf("updating start: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qe->_estimate, qe->_sum, qe->_length);
 #endif
-                    assert(start_qe[i1][i2] != NULL);
-                    if (qe->_estimate < start_qe[i1][i2]->_estimate)
+                    assert(node->_qe != NULL);
+                    if (qe->_estimate < node->_qe->_estimate)
                     {
-                        start_qe[i1][i2] = qe;
-                        qe = (QueueElement*)fh_replacedata(start_heap, (struct fibheap_el*)start_he[i1][i2], (void*)qe);
+                        node->_qe = qe;
+                        qe = (QueueElement*)fh_replacedata(start_heap, (struct fibheap_el*)node->_he, (void*)qe);
+                        start_frontier.erase(i1 - i2, qe->_sum);
+                        start_frontier.insert(i1 - i2, node->_qe->_sum);
                     }
-                    delete qe;
+                    pool.free(qe);
                     break;
                 default:
                     assert(false); // should not reach here
@@ -188,15 +283,18 @@ score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& vide
         // check end frontier
         qe = (QueueElement*)fh_extractmin(end_heap);
         assert(qe); // there is always a path
-        assert(end_state[qe->_i1][qe->_i2] == OPEN); // this node should be open
+        node = end_nodes.find(qe->_i1, qe->_i2);
+        other = start_nodes.find(qe->_i1, qe->_i2);
+        assert(node && node->_state == OPEN); // this node should be open
 #ifdef DEBUG
         printf("extract from end: (%d,%d) est=%.4f sum=%.4f len=%d\n", qe->_i1, qe->_i2, qe->_estimate, qe->_sum, qe->_length);
 #endif
-        end_state[qe->_i1][qe->_i2] = CLOSED;
-        end_frontier.erase(coord_t(qe->_i1, qe->_i2));
-        if (start_state[qe->_i1][qe->_i2] == CLOSED) // we have found a path, might not be optimal
+        node->_state = CLOSED;
+        expansions++;
+        end_frontier.erase(qe->_i1 - qe->_i2, qe->_sum);
+        if (other && other->_state == CLOSED) // we have found a path, might not be optimal
         {
-            qs = start_qe[qe->_i1][qe->_i2];
+            qs = other->_qe;
             if (qs->_sum + qe->_sum < sum)
             {
                 sum = qs->_sum + qe->_sum;
@@ -214,59 +312,61 @@ score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& vide
             case 1: i1 = qe->_i1; i2 = qe->_i2 - 1; break; // insert frame
             case 2: i1 = qe->_i1 - 1; i2 = qe->_i2; break; // delete frame
             }
-            if (i1 >= 0 && i2 >= 0 && end_state[i1][i2] != CLOSED)
+            if (i1 < 0 || i2 < 0)
+                continue;
+            node = end_nodes.find(i1, i2);
+            if (node == NULL || node->_state != CLOSED)
             {
+                // compute heuristic based on other frontier
+                score_t best_heuristic = element_heuristic(i1, i2, 0, 0);
+                other = start_nodes.find(i1, i2);
+                if (other && other->_state == CLOSED)
+                    best_heuristic = other->_qe->_sum;
+                else
+                    best_heuristic = min(best_heuristic, start_frontier.query(i1 - i2));
+#ifdef DEBUG
+                printf("best heuristic for (%d,%d) is %.4f\n", i1, i2, best_heuristic);
+#endif
+                score_t least = prune ? cutoff(sum, qe->_sum, best_heuristic) : -INF;
                 switch (dir)
                 {
-                case 0: s = 1.0 - v.compute_frame_score(video1, video2, i1, i2); break;
+                case 0: s = 1.0 - v.compute_frame_score(video1, video2, i1, i2, least); break;
                 case 1: s = 1.0 - INSERTED_FRAME; break;
                 case 2: s = 1.0 - DELETED_FRAME; break;
                 }
-                qs = new QueueElement(i1, i2);
+                if (1.0 - s < least)
+                    continue; // cannot improve on the best path found so far
+                qs = new (pool.alloc()) QueueElement(i1, i2);
                 qs->_sum = qe->_sum + s;
                 qs->_length = qe->_length + 1;
-                // compute heuristic based on other frontier
-                score_t best_heuristic = element_heuristic(i1, i2, 0, 0), h = 0;
-                if (start_state[i1][i2] == CLOSED)
-                {
-                    best_heuristic = start_qe[i1][i2]->_sum;
-                }
-                else
-                {
-                    for (FrontierSet::const_iterator it = start_frontier.begin(); it != start_frontier.end(); ++it)
-                    {
-                        h = element_heuristic(i1, i2, it->first, it->second) + start_qe[it->first][it->second]->_sum;
-                        best_heuristic = min(best_heuristic, h);
-                    }
-                }
-#ifdef DEBUG
-                printf("best heuristic for (%d,%d) is %.4f\n", i1, i2, best_heuristic);
-#endif
-                qs->_estimate = qs->_sum + best_heuristic;
-                // extend frontier
-                end_frontier.insert(coord_t(i1, i2));
-                switch (end_state[i1][i2])
+                qs->_estimate = qs->_sum + weight * best_heuristic;
+                if (node == NULL)
+                    node = &end_nodes.insert(i1, i2);
+                switch (node->_state)
                 {
                 case NONE:
 #ifdef DEBUG
                     printf("expanding end: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qs->_estimate, qs->_sum, qs->_length);
 #endif
-                    assert(end_qe[i1][i2] == NULL);
-                    end_he[i1][i2] = fh_insert(end_heap, (void*)qs);
-                    end_qe[i1][i2] = qs;
-                    end_state[i1][i2] = OPEN;
+                    assert(node->_qe == NULL);
+                    node->_he = fh_insert(end_heap, (void*)qs);
+                    node->_qe = qs;
+                    node->_state = OPEN;
+                    end_frontier.insert(i1 - i2, qs->_sum); // extend frontier
                     break;
                 case OPEN:
 #ifdef DEBUG
                     printf("updating end: (%d,%d) est=%.4f sum=%.4f len=%d\n", i1, i2, qs->_estimate, qs->_sum, qs->_length);
 #endif
-                    assert(end_qe[i1][i2] != NULL);
-                    if (qs->_estimate < end_qe[i1][i2]->_estimate)
+                    assert(node->_qe != NULL);
+                    if (qs->_estimate < node->_qe->_estimate)
                     {
-                        end_qe[i1][i2] = qs;
-                        qs = (QueueElement*)fh_replacedata(end_heap, (struct fibheap_el*)end_he[i1][i2], (void*)qs);
+                        node->_qe = qs;
+                        qs = (QueueElement*)fh_replacedata(end_heap, (struct fibheap_el*)node->_he, (void*)qs);
+                        end_frontier.erase(i1 - i2, qs->_sum);
+                        end_frontier.insert(i1 - i2, node->_qe->_sum);
                     }
-                    delete qs;
+                    pool.free(qs);
                     break;
                 default:
                     assert(false); // should not reach here
@@ -282,30 +382,30 @@ score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& vide
     printf("Length = %d\n", length);
 #endif
 #ifdef FH_STATS
-    printf("MaxN = %d %d\n", fh_maxn(start_heap), fh_maxn(end_heap));
-    printf("Inserts = %d %d\n", fh_ninserts(start_heap), fh_ninserts(end_heap));
-    printf("Extracts = %d %d\n", fh_nextracts(start_heap), fh_nextracts(end_heap));
+    if (!options._quiet)
+    {
+        printf("MaxN = %ld %ld\n", fh_maxn(start_heap), fh_maxn(end_heap));
+        printf("Inserts = %ld %ld\n", fh_ninserts(start_heap), fh_ninserts(end_heap));
+        printf("Extracts = %ld %ld\n", fh_nextracts(start_heap), fh_nextracts(end_heap));
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("Nodes = %lu %lu\n", (unsigned long)start_nodes.size(), (unsigned long)end_nodes.size());
+        printf("SearchMemory = %lu KB\n", (unsigned long)((start_nodes.bytes() + end_nodes.bytes() + pool.bytes()) / 1024));
+        printf("PeakMemory = %ld KB\n", usage.ru_maxrss);
+    }
 #endif
 
     // clean up
     fh_deleteheap(start_heap);
     fh_deleteheap(end_heap);
-    for (uint16_t i1 = 0; i1 <= n1; i1++)
+
+    if (result)
     {
-        for (uint16_t i2 = 0; i2 <= n2; i2++)
-        {
-            if (start_qe[i1][i2])
-                delete start_qe[i1][i2];
-            if (end_qe[i1][i2])
-                delete end_qe[i1][i2];
-        }
+        // we stop once the smallest weighted estimate reaches sum, and the weighted estimate of a node
+        // on an optimal path is at most weight times the optimal cost.
+        result->set(sum, sum / weight, length, n1, n2);
+        result->_expansions = expansions;
     }
-    delete_table(start_he, n1 + 1, n2 + 1);
-    delete_table(end_he, n1 + 1, n2 + 1);
-    delete_table(start_qe, n1 + 1, n2 + 1);
-    delete_table(end_qe, n1 + 1, n2 + 1);
-    delete_table(start_state, n1 + 1, n2 + 1);
-    delete_table(end_state, n1 + 1, n2 + 1);
 
     return 1.0 - sum / length;
 }
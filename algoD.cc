@@ -5,81 +5,185 @@
  * Edit distance DP algorithm.
  */ 
 
+#include <vector>
+#include <deque>
 #include "vqats.hh"
-#include "dtable.hh"
+
+#define min(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b; })
+#define max(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b; })
 
 struct CellData
 {
     score_t _sum; // cumulative score
-    uint16_t _length; // path length
+    uint32_t _length; // path length
 };
 
-score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2)
+// costs of the moves within a block of identical frame pairs
+struct BlockCosts
 {
-    uint16_t n1 = v._video_map[video1]._frames.size();
-    uint16_t n2 = v._video_map[video2]._frames.size();    
-    CellData** cells = new_table<CellData>(n1 + 1, n2 + 1);
-    // initial values
-    cells[0][0]._sum = 0.0;
-    cells[0][0]._length = 0;
-    for (uint16_t i1 = 1; i1 <= n1; i1++)
+    score_t _diagonal, _deleted, _inserted;
+    uint32_t _diagonal_moves; // moves per diagonal step, 2 when deleting and inserting beats matching
+};
+
+// within a block every diagonal step costs the same, so the cheapest way across dx rows and dy columns
+// takes as many diagonal steps as it can
+static inline void relax(CellData& c, const CellData& from, int dx, int dy, const BlockCosts& k)
+{
+    int m = min(dx, dy);
+    score_t sum = from._sum + m * k._diagonal + (dx - m) * k._deleted + (dy - m) * k._inserted;
+    if (sum < c._sum)
+    {
+        c._sum = sum;
+        c._length = from._length + m * k._diagonal_moves + (dx - m) + (dy - m);
+    }
+}
+
+// computes the bottom side out[0..b] of an a x b block from its top side top[0..b] and left side left[0..a].
+// for each target the best source on each stretch of a side is found with a sliding window minimum or with
+// prefix and suffix minima, keyed on the part of the cost that does not depend on the target.
+static void transfer(const CellData* top, const CellData* left, int a, int b, const BlockCosts& k, CellData* out)
+{
+#define KEY_NEAR(y0) (top[y0]._sum - (y0) * (k._diagonal - k._deleted)) // from (0, y0) with y - y0 <= a
+#define KEY_FAR(y0) (top[y0]._sum - (y0) * k._inserted) // from (0, y0) with y - y0 > a
+#define KEY_LOW(x0) (left[x0]._sum - (x0) * k._deleted) // from (x0, 0) with y <= a - x0
+#define KEY_HIGH(x0) (left[x0]._sum - (x0) * (k._diagonal - k._inserted)) // from (x0, 0) with y > a - x0
+    std::vector<int> low(a + 1), high(a + 2);
+    for (int x0 = 1; x0 <= a; x0++)
+        low[x0] = x0 > 1 && KEY_LOW(low[x0 - 1]) <= KEY_LOW(x0) ? low[x0 - 1] : x0;
+    high[a + 1] = -1;
+    for (int x0 = a; x0 >= 1; x0--)
+        high[x0] = high[x0 + 1] >= 0 && KEY_HIGH(high[x0 + 1]) < KEY_HIGH(x0) ? high[x0 + 1] : x0;
+
+    std::deque<int> window; // sources y0 in [y - a, y], with increasing keys
+    int far = -1; // best source y0 < y - a
+    out[0] = left[a];
+    for (int y = 0; y <= b; y++)
     {
-        cells[i1][0]._sum = (1.0 - DELETED_FRAME) * i1;
-        cells[i1][0]._length = i1;
+        while (!window.empty() && KEY_NEAR(window.back()) > KEY_NEAR(y))
+            window.pop_back();
+        window.push_back(y);
+        if (y - a - 1 >= 0 && (far < 0 || KEY_FAR(y - a - 1) < KEY_FAR(far)))
+            far = y - a - 1;
+        while (window.front() < y - a)
+            window.pop_front();
+        if (y == 0)
+            continue;
+
+        CellData& c = out[y];
+        c._sum = INF;
+        c._length = 0;
+        relax(c, top[window.front()], a, y - window.front(), k);
+        if (far >= 0)
+            relax(c, top[far], a, y - far, k);
+        if (a - y >= 1)
+            relax(c, left[low[a - y]], a - low[a - y], y, k);
+        int x0 = high[max(1, a - y + 1)];
+        relax(c, left[x0], a - x0, y, k);
     }
-    for (uint16_t i2 = 1; i2 <= n2; i2++)
+#undef KEY_NEAR
+#undef KEY_FAR
+#undef KEY_LOW
+#undef KEY_HIGH
+}
+
+// first frame of each run of repeated frames, followed by the number of frames
+static std::vector<frame_t> find_runs(VideoData& video)
+{
+    std::vector<frame_t> runs;
+    for (frame_t i = 0; i < video._frames.size(); i++)
+        if (video.frame(i)._run == i)
+            runs.push_back(i);
+    runs.push_back(video._frames.size());
+    return runs;
+}
+
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options, SearchResult* result)
+{
+    frame_t n1 = v._video_map[video1]._frames.size();
+    frame_t n2 = v._video_map[video2]._frames.size();    
+    // repeated frames are collapsed into blocks of the grid that share one frame score. only the sides
+    // of the blocks are computed, and only the row of sides above the current blocks is kept.
+    std::vector<frame_t> runs1 = find_runs(v._video_map[video1]);
+    std::vector<frame_t> runs2 = find_runs(v._video_map[video2]);
+    std::vector<CellData> prev(n2 + 1), cells(n2 + 1), left, right;
+    // initial values
+    cells[0]._sum = 0.0;
+    cells[0]._length = 0;
+    for (frame_t i2 = 1; i2 <= n2; i2++)
     {
-        cells[0][i2]._sum = (1.0 - INSERTED_FRAME) * i2;
-        cells[0][i2]._length = i2;
+        cells[i2]._sum = (1.0 - INSERTED_FRAME) * i2;
+        cells[i2]._length = i2;
     }
-    // do dynamic programming method for computing minimum average frame score
-    for (uint16_t i1 = 1; i1 <= n1; i1++)
+#ifdef DEBUG
+    for (frame_t i2 = 0; i2 <= n2; i2++)
+        printf("%3.2f ", cells[i2]._sum);
+    printf("\n");
+#endif
+    // do dynamic programming method for computing minimum average frame score. with a scheduler, the frame
+    // scores of SCORE_TILE rows of blocks are computed in parallel before the rows are swept.
+    size_t blocks2 = runs2.size() - 1;
+    std::vector<std::pair<frame_t, frame_t> > pairs;
+    std::vector<score_t> scores;
+    for (size_t r1 = 0; r1 + 1 < runs1.size(); r1++)
     {
-        for (uint16_t i2 = 1; i2 <= n2; i2++)
+        if (options._scheduler && r1 % SCORE_TILE == 0)
         {
-            score_t best_sum = INF;
-            uint16_t best_length = 0;
-            score_t new_sum = 0;
-            new_sum = cells[i1 - 1][i2 - 1]._sum + 1.0 - v.compute_frame_score(video1, video2, i1 - 1, i2 - 1);
-            if (new_sum < best_sum)
-            {
-                best_sum = new_sum;
-                best_length = cells[i1 - 1][i2 - 1]._length + 1;
-            }
-            new_sum = cells[i1 - 1][i2]._sum + 1.0 - DELETED_FRAME;
-            if (new_sum < best_sum)
-            {
-                best_sum = new_sum;
-                best_length = cells[i1 - 1][i2]._length + 1;
-            }
-            new_sum = cells[i1][i2 - 1]._sum + 1.0 - INSERTED_FRAME;
-            if (new_sum < best_sum)
+            pairs.clear();
+            for (size_t k = r1; k < r1 + SCORE_TILE && k + 1 < runs1.size(); k++)
+                for (size_t r2 = 0; r2 < blocks2; r2++)
+                    pairs.push_back(std::make_pair(runs1[k], runs2[r2]));
+            v.score_pairs(video1, video2, pairs, scores, *options._scheduler);
+        }
+        prev.swap(cells);
+        frame_t i1 = runs1[r1];
+        int a = runs1[r1 + 1] - i1;
+        left.resize(a + 1);
+        right.resize(a + 1);
+        for (int x = 0; x <= a; x++)
+        {
+            left[x]._sum = (1.0 - DELETED_FRAME) * (i1 + x);
+            left[x]._length = i1 + x;
+        }
+        for (size_t r2 = 0; r2 + 1 < runs2.size(); r2++)
+        {
+            frame_t i2 = runs2[r2];
+            int b = runs2[r2 + 1] - i2;
+            BlockCosts down, across;
+            down._diagonal = across._diagonal = 1.0 - (options._scheduler ? scores[(r1 % SCORE_TILE) * blocks2 + r2] :
+                                                       v.compute_frame_score(video1, video2, i1, i2));
+            down._diagonal_moves = across._diagonal_moves = 1;
+            if (down._diagonal > 2.0 - DELETED_FRAME - INSERTED_FRAME)
             {
-                best_sum = new_sum;
-                best_length = cells[i1][i2 - 1]._length + 1;
+                down._diagonal = across._diagonal = 2.0 - DELETED_FRAME - INSERTED_FRAME;
+                down._diagonal_moves = across._diagonal_moves = 2;
             }
-            cells[i1][i2]._sum = best_sum;
-            cells[i1][i2]._length = best_length;
+            down._deleted = across._inserted = 1.0 - DELETED_FRAME;
+            down._inserted = across._deleted = 1.0 - INSERTED_FRAME;
+            transfer(&prev[i2], &left[0], a, b, down, &cells[i2]);
+            transfer(&left[0], &prev[i2], b, a, across, &right[0]); // the right side, with the block transposed
+            left.swap(right);
         }
-    }
-    score_t sum = cells[n1][n2]._sum;
-    uint16_t length = cells[n1][n2]._length;
-    
 #ifdef DEBUG
-    for (uint16_t i1 = 0; i1 <= n1; i1++)
-    {
-        for (uint16_t i2 = 0; i2 <= n2; i2++)
-            printf("%3.2f ", cells[i1][i2]._sum);
+        for (frame_t i2 = 0; i2 <= n2; i2++)
+            printf("%3.2f ", cells[i2]._sum);
         printf("\n");
+#endif
     }
+    score_t sum = cells[n2]._sum;
+    uint32_t length = cells[n2]._length;
+    
+#ifdef DEBUG
     printf("Sum = %f\n",  sum);
     printf("Length = %d\n", length);
 #endif
-    
-    // clean up
-    delete_table(cells, n1 + 1, n2 + 1);
+
+    if (result)
+    {
+        result->set(sum, sum, length, n1, n2);
+        result->_expansions = (unsigned long)(runs1.size() - 1) * (runs2.size() - 1); // blocks
+    }
 
     return 1.0 - sum / length;
 }
 
-
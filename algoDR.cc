@@ -3,125 +3,260 @@
  * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
  *
  * Edit distance DP algorithm with recovery.
+ *
+ * With the proxy option, the DP runs on proxy scores taken from the frame
+ * thumbnails, and full SSIM is computed only for the frames matched on the path
+ * found, which makes n exact frame scores instead of n^2. Matches whose proxy
+ * and exact scores differ by more than PROXY_TOLERANCE are reported as suspect,
+ * since the exact alignment may well differ around them.
  */ 
 
+#include <math.h>
 #include <vector>
+#include <set>
 #include "vqats.hh"
 #include "dtable.hh"
 
+#ifndef PROXY_TOLERANCE
+    #define PROXY_TOLERANCE 0.1 // largest difference between the proxy and exact score of a match that is not suspect
+#endif
+
 struct CellData
 {
-    score_t _score; // score of this cell
     score_t _sum; // cumulative score
-    uint16_t _length; // path length
-    char _path; // which way to reverse: 0 = diagonal, 1 = decrease i1, 2 = decrease i2
+    uint32_t _length; // path length
+};
+
+// which way to reverse, stored in the packed path table
+enum path_t
+{
+    DIAGONAL = 0,
+    DECREASE_I1, // deleted frame
+    DECREASE_I2 // inserted frame
 };
 
-score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2)
+// computes row i1 of the DP from row i1 - 1, storing the backpointers of the row in row r of the path table if given
+static void relax_row(VQATS& v, const video_t& video1, const video_t& video2, const frame_t& n2, bool proxy, frame_t i1,
+                      const std::vector<CellData>& prev, std::vector<CellData>& cells, PackedTable* paths, size_t r)
 {
-    uint16_t n1 = v._video_map[video1]._frames.size();
-    uint16_t n2 = v._video_map[video2]._frames.size();    
-    CellData** cells = new_table<CellData>(n1 + 1, n2 + 1);
-    // initial values
-    cells[0][0]._score = 0.0;
-    cells[0][0]._sum = 0.0;
-    cells[0][0]._length = 0;
-    cells[0][0]._path = 0;
-    for (uint16_t i1 = 1; i1 <= n1; i1++)
+    if (i1 == 0)
     {
-        cells[i1][0]._score = DELETED_FRAME;
-        cells[i1][0]._sum = cells[i1 - 1][0]._sum + 1.0 - cells[i1][0]._score;
-        cells[i1][0]._length = i1;
-        cells[i1][0]._path = 1;
+        cells[0]._sum = 0.0;
+        cells[0]._length = 0;
+        for (frame_t i2 = 1; i2 <= n2; i2++)
+        {
+            cells[i2]._sum = cells[i2 - 1]._sum + 1.0 - INSERTED_FRAME;
+            cells[i2]._length = i2;
+        }
+        return;
     }
-    for (uint16_t i2 = 1; i2 <= n2; i2++)
+    cells[0]._sum = prev[0]._sum + 1.0 - DELETED_FRAME;
+    cells[0]._length = i1;
+    if (paths) paths->set(r, 0, DECREASE_I1);
+    for (frame_t i2 = 1; i2 <= n2; i2++)
     {
-        cells[0][i2]._score = INSERTED_FRAME;
-        cells[0][i2]._sum = cells[0][i2 - 1]._sum + 1.0 - cells[0][i2]._score;
-        cells[0][i2]._length = i2;
-        cells[0][i2]._path = 2;
+        score_t best_sum = INF;
+        uint32_t best_length = 0;
+        path_t best_path = DIAGONAL;
+        score_t new_sum = 0;
+        score_t new_score = proxy ? v.proxy_frame_score(video1, video2, i1 - 1, i2 - 1)
+                                  : v.compute_frame_score(video1, video2, i1 - 1, i2 - 1);
+        new_sum = prev[i2 - 1]._sum + 1.0 - new_score;
+        if (new_sum < best_sum)
+        {
+            best_sum = new_sum;
+            best_length = prev[i2 - 1]._length + 1;
+            best_path = DIAGONAL;
+        }
+        new_sum = prev[i2]._sum + 1.0 - DELETED_FRAME;
+        if (new_sum < best_sum)
+        {
+            best_sum = new_sum;
+            best_length = prev[i2]._length + 1;
+            best_path = DECREASE_I1;
+        }
+        new_sum = cells[i2 - 1]._sum + 1.0 - INSERTED_FRAME;
+        if (new_sum < best_sum)
+        {
+            best_sum = new_sum;
+            best_length = cells[i2 - 1]._length + 1;
+            best_path = DECREASE_I2;
+        }
+        cells[i2]._sum = best_sum;
+        cells[i2]._length = best_length;
+        if (paths) paths->set(r, i2, best_path);
     }
+}
+
+// rows between checkpoints, so that the checkpoint rows of sums and the backpointers of one stretch of rows take
+// about as much memory each, O(sqrt(n1) * n2) in all
+static frame_t checkpoint_stride(frame_t n1)
+{
+    return (frame_t)ceil(sqrt(64.0 * (n1 + 1))); // a cell of sums takes 16 bytes, a backpointer a quarter of one
+}
+
+// runs the DP, keeping the rows of sums at every stride-th row, and returns the cost and length of the path found
+static score_t align(VQATS& v, const video_t& video1, const video_t& video2, const frame_t& n1, const frame_t& n2,
+                     bool proxy, frame_t stride, std::vector<std::vector<CellData> >& checkpoints, uint32_t& length)
+{
+    std::vector<CellData> prev(n2 + 1), cells(n2 + 1);
+    checkpoints.assign(n1 / stride + 1, std::vector<CellData>());
+    relax_row(v, video1, video2, n2, proxy, 0, prev, cells, NULL, 0);
+    checkpoints[0] = cells;
+#ifdef DEBUG
+    for (frame_t i2 = 0; i2 <= n2; i2++)
+        printf("%3.2f ", cells[i2]._sum);
+    printf("\n");
+#endif
     // do dynamic programming method for computing minimum average frame score
-    for (uint16_t i1 = 1; i1 <= n1; i1++)
+    for (frame_t i1 = 1; i1 <= n1; i1++)
+    {
+        prev.swap(cells);
+        relax_row(v, video1, video2, n2, proxy, i1, prev, cells, NULL, 0);
+        if (i1 % stride == 0)
+            checkpoints[i1 / stride] = cells;
+#ifdef DEBUG
+        for (frame_t i2 = 0; i2 <= n2; i2++)
+            printf("%3.2f ", cells[i2]._sum);
+        printf("\n");
+#endif
+    }
+    length = cells[n2]._length;
+    return cells[n2]._sum;
+}
+
+// walks the path back from the end, returning the cells of the path and the moves into them, from the end back.
+// the rows from each checkpoint to the row the path is in are computed again with their backpointers, up to the
+// column the path is in, as it only moves left from there. their frame scores are taken from the memo while it
+// holds them, but the memo stops growing at MEMO_SIZE pairs, and past that every cell left of the path is scored
+// again: for long videos, recovery costs about as many frame scores again as align, less the cells right of the
+// path.
+static void recover(VQATS& v, const video_t& video1, const video_t& video2, frame_t n1, frame_t n2, bool proxy,
+                    frame_t stride, const std::vector<std::vector<CellData> >& checkpoints,
+                    std::vector<std::pair<frame_t, frame_t> >& path_cells, std::vector<char>& path_action)
+{
+    PackedTable paths(stride, n2 + 1); // rows start + 1 to start + stride
+    std::vector<CellData> prev(n2 + 1), cells(n2 + 1);
+    frame_t i1 = n1; 
+    frame_t i2 = n2;
+    while (i1 > 0)
     {
-        for (uint16_t i2 = 1; i2 <= n2; i2++)
+        frame_t start = (i1 - 1) / stride * stride;
+        cells = checkpoints[start / stride];
+        for (frame_t k = start + 1; k <= i1; k++)
         {
-            score_t best_sum = INF;
-            uint16_t best_length = 0;
-            char best_path = 0;
-            score_t best_score = 0;
-            score_t new_sum = 0;
-            score_t new_score = v.compute_frame_score(video1, video2, i1 - 1, i2 - 1);
-            new_sum = cells[i1 - 1][i2 - 1]._sum + 1.0 - new_score;
-            if (new_sum < best_sum)
-            {
-                best_sum = new_sum;
-                best_length = cells[i1 - 1][i2 - 1]._length + 1;
-                best_path = 0;
-                best_score = new_score;
-            }
-            new_sum = cells[i1 - 1][i2]._sum + 1.0 - DELETED_FRAME;
-            if (new_sum < best_sum)
-            {
-                best_sum = new_sum;
-                best_length = cells[i1 - 1][i2]._length + 1;
-                best_path = 1;
-                best_score = DELETED_FRAME;
-            }
-            new_sum = cells[i1][i2 - 1]._sum + 1.0 - INSERTED_FRAME;
-            if (new_sum < best_sum)
+            prev.swap(cells);
+            relax_row(v, video1, video2, i2, proxy, k, prev, cells, &paths, k - start - 1);
+        }
+        while (i1 > start)
+        {
+            char action = paths.get(i1 - start - 1, i2);
+            path_action.push_back(action);
+            path_cells.push_back(std::make_pair(i1, i2));
+            switch (action)
             {
-                best_sum = new_sum;
-                best_length = cells[i1][i2 - 1]._length + 1;
-                best_path = 2;
-                best_score = INSERTED_FRAME;
+                case DIAGONAL: i1--; i2--; break;
+                case DECREASE_I1: i1--; break;
+                case DECREASE_I2: i2--; break;
             }
-            cells[i1][i2]._score = best_score;
-            cells[i1][i2]._sum = best_sum;
-            cells[i1][i2]._length = best_length;
-            cells[i1][i2]._path = best_path;
         }
     }
-    score_t sum = cells[n1][n2]._sum;
-    uint16_t length = cells[n1][n2]._length;
-    
-#ifdef DEBUG
-    for (uint16_t i1 = 0; i1 <= n1; i1++)
+    for (; i2 > 0; i2--) // along row 0
     {
-        for (uint16_t i2 = 0; i2 <= n2; i2++)
-            printf("%3.2f ", cells[i1][i2]._sum);
-        printf("\n");
+        path_action.push_back(DECREASE_I2);
+        path_cells.push_back(std::make_pair(i1, i2));
     }
+}
+
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options, SearchResult* result)
+{
+    frame_t n1 = v._video_map[video1]._frames.size();
+    frame_t n2 = v._video_map[video2]._frames.size();    
+    frame_t stride = checkpoint_stride(n1);
+    std::vector<std::vector<CellData> > checkpoints;
+    uint32_t length;
+    score_t sum = align(v, video1, video2, n1, n2, options._proxy, stride, checkpoints, length);
+    
+#ifdef DEBUG
     printf("Sum = %f\n",  sum);
     printf("Length = %d\n", length);
 #endif
 
-    // recover path
-    std::vector<score_t> path_score;
+    // recover path. scores of matched frames are not stored, so they are computed again, one per match. with
+    // proxy scores, these are the only exact scores computed, and the cost of the path is taken from them.
+    std::vector<std::pair<frame_t, frame_t> > path_cells;
     std::vector<char> path_action;
-    uint16_t i1 = n1; 
-    uint16_t i2 = n2;
-    while (i1 > 0 || i2 > 0)
+    recover(v, video1, video2, n1, n2, options._proxy, stride, checkpoints, path_cells, path_action);
+    score_t path_sum = 0;
+    unsigned long suspects = 0;
+    for (int i = path_action.size() - 1; i >= 0; i--)
     {
-        path_action.push_back(cells[i1][i2]._path);
-        path_score.push_back(cells[i1][i2]._score);
-        switch (cells[i1][i2]._path)
+        const char* action = path_action[i] == DIAGONAL ? "MATCH   " : path_action[i] == DECREASE_I1 ? "DELETED " : "INSERTED";
+        score_t score = path_action[i] == DIAGONAL ? v.compute_frame_score(video1, video2, path_cells[i].first - 1, path_cells[i].second - 1)
+            : path_action[i] == DECREASE_I1 ? DELETED_FRAME : INSERTED_FRAME;
+        path_sum += 1.0 - score;
+        if (options._proxy && path_action[i] == DIAGONAL)
         {
-            case 0: i1--; i2--; break;
-            case 1: i1--; break;
-            case 2: i2--; break;
+            score_t proxy = v.proxy_frame_score(video1, video2, path_cells[i].first - 1, path_cells[i].second - 1);
+            bool suspect = score - proxy > PROXY_TOLERANCE || proxy - score > PROXY_TOLERANCE;
+            suspects += suspect;
+            if (!options._quiet)
+                printf("Action = %s Score = %f Proxy = %f%s\n", action, score, proxy, suspect ? " Suspect" : "");
         }
+        else if (!options._quiet)
+            printf("Action = %s Score = %f\n", action, score);
     }
-    for (int i = path_action.size() - 1; i >= 0; i--)
+
+    if (options._proxy)
     {
-        const char* action = path_action[i] == 0 ? "MATCH   " : path_action[i] == 1 ? "DELETED " : "INSERTED";
-        printf("Action = %s Score = %f\n", action, path_score[i]);
+        if (!options._quiet)
+            printf("ProxyScore = %.4f\n", 1.0 - sum / length);
+        sum = path_sum;
+        if (!options._quiet)
+        {
+            printf("ProxyScores = %lu\n", v.proxy_scores());
+            printf("Suspects = %lu\n", suspects);
+        }
     }
-            
-    // clean up
-    delete_table(cells, n1 + 1, n2 + 1);
 
-    return 1.0 - sum / length;
-}
+    if (options._proxy && options._compare)
+    {
+        // the exact DP, to tell how many matches of the proxy path it does not make
+        uint32_t exact_length;
+        unsigned long frame_scores = v.frame_scores(), memo_lookups = v.memo_lookups(), memo_hits = v.memo_hits();
+        score_t exact_sum = align(v, video1, video2, n1, n2, false, stride, checkpoints, exact_length);
+        unsigned long exact_lookups = v.memo_lookups() - memo_lookups;
+        std::vector<std::pair<frame_t, frame_t> > exact_cells;
+        std::vector<char> exact_action;
+        recover(v, video1, video2, n1, n2, false, stride, checkpoints, exact_cells, exact_action);
+        std::set<std::pair<frame_t, frame_t> > exact_matches;
+        for (size_t i = 0; i < exact_action.size(); i++)
+            if (exact_action[i] == DIAGONAL)
+                exact_matches.insert(exact_cells[i]);
+        unsigned long matches = 0, disagreements = 0;
+        for (size_t i = 0; i < path_action.size(); i++)
+        {
+            if (path_action[i] != DIAGONAL)
+                continue;
+            matches++;
+            disagreements += exact_matches.count(path_cells[i]) == 0;
+        }
+        score_t exact_score = 1.0 - exact_sum / exact_length;
+        printf("ExactScore = %.4f\n", exact_score);
+        printf("ExactFrameScores = %lu\n", exact_lookups); // asked for, as some are in the memo already
+        // the frame scores reported are those of the proxy search
+        v.reset_counters(frame_scores, memo_lookups, memo_hits);
+        printf("Disagreements = %lu of %lu\n", disagreements, matches);
+        printf("Deviation = %.4f\n", (1.0 - sum / length) - exact_score);
+    }
 
+    if (result)
+    {
+        // a path found on proxy scores need not be optimal, so only the trivial lower bound holds then
+        result->set(sum, options._proxy ? 0 : sum, length, n1, n2);
+        result->_expansions = (unsigned long)n1 * n2;
+    }
 
+    return 1.0 - sum / length;
+}
@@ -3,26 +3,148 @@
  * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
  *
  * No alignment.
+ *
+ * Frame i of one video is scored against frame i of the other. The frame pairs
+ * go through a pipeline of decoding, preprocessing (colour conversion and window
+ * statistics) and scoring, each stage with its own threads, joined by bounded
+ * queues. A fixed number of slots, each holding the buffers of one frame pair,
+ * go round the pipeline, so memory is bounded and buffers are reused.
  */ 
 
 #include <vector>
 #include "vqats.hh"
+#include "sched.hh"
 
 #define min(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b; })
 #define max(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b; })
 
-score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2)
+#ifndef PIPELINE_SLOTS
+    #define PIPELINE_SLOTS 3 // frame pairs in the pipeline at once, per thread of each stage
+#endif
+
+// the buffers of one frame pair, and the pair they hold now
+struct PipelineSlot
+{
+    size_t _pair; // index into the pairs scored
+    bool _ok; // whether both frames could be read
+    FrameData _frame1, _frame2;
+};
+
+struct Pipeline
+{
+    Pipeline(size_t slots) : _free(slots), _decoded(slots), _prepared(slots), _next(0), _decoders(0), _preprocessors(0) { }
+
+    VQATS* _v;
+    const std::vector<std::pair<std::string, std::string> >* _paths; // frames of each pair to score
+    std::vector<score_t> _scores;
+    BoundedQueue<PipelineSlot*> _free, _decoded, _prepared;
+    volatile size_t _next; // next pair to decode
+    volatile int _decoders, _preprocessors; // threads of these stages still running
+};
+
+static void* decode_stage(void* arg)
+{
+    Pipeline* p = (Pipeline*)arg;
+    PipelineSlot* slot;
+    while (true)
+    {
+        size_t k = __sync_fetch_and_add(&p->_next, 1);
+        if (k >= p->_paths->size() || !p->_free.pop(slot))
+            break;
+        slot->_pair = k;
+        slot->_frame1.recycle((*p->_paths)[k].first);
+        slot->_frame2.recycle((*p->_paths)[k].second);
+        slot->_ok = slot->_frame1.decode() && slot->_frame2.decode();
+        p->_decoded.push(slot);
+    }
+    if (__sync_sub_and_fetch(&p->_decoders, 1) == 0)
+        p->_decoded.close();
+    return NULL;
+}
+
+static void* preprocess_stage(void* arg)
+{
+    Pipeline* p = (Pipeline*)arg;
+    PipelineSlot* slot;
+    while (p->_decoded.pop(slot))
+    {
+        if (slot->_ok)
+        {
+            slot->_frame1.preprocess();
+            slot->_frame2.preprocess();
+        }
+        p->_prepared.push(slot);
+    }
+    if (__sync_sub_and_fetch(&p->_preprocessors, 1) == 0)
+        p->_prepared.close();
+    return NULL;
+}
+
+static void* score_stage(void* arg)
 {
-    uint16_t n1 = v._video_map[video1]._frames.size();
-    uint16_t n2 = v._video_map[video2]._frames.size();    
+    Pipeline* p = (Pipeline*)arg;
+    PipelineSlot* slot;
+    while (p->_prepared.pop(slot))
+    {
+        // rounded as compute_frame_score does, so that the scores are the same as from the memo
+        p->_scores[slot->_pair] = slot->_ok ? (float)p->_v->frame_ssim(slot->_frame1, slot->_frame2, -INF) : 0.0;
+        p->_free.push(slot);
+    }
+    return NULL;
+}
+
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options, SearchResult* result)
+{
+    VideoData& data1 = v._video_map[video1];
+    VideoData& data2 = v._video_map[video2];
+    frame_t n1 = data1._frames.size();
+    frame_t n2 = data2._frames.size();    
+
+    // the first frames of the runs stand for the others, so a pair that repeats the pair before it is not scored again
+    std::vector<std::pair<std::string, std::string> > paths;
+    std::vector<size_t> pair_of(min(n1, n2));
+    for (frame_t i = 0; i < min(n1, n2); i++)
+    {
+        frame_t run1 = data1.frame(i)._run, run2 = data2.frame(i)._run;
+        if (i == 0 || run1 != data1.frame(i - 1)._run || run2 != data2.frame(i - 1)._run)
+            paths.push_back(std::make_pair(data1.frame(run1)._path, data2.frame(run2)._path));
+        pair_of[i] = paths.size() - 1;
+    }
+
+    int threads = max(options._threads, 1);
+    std::vector<PipelineSlot> slots(PIPELINE_SLOTS * threads);
+    Pipeline p(slots.size());
+    p._v = &v;
+    p._paths = &paths;
+    p._scores.resize(paths.size());
+    p._decoders = p._preprocessors = threads;
+    for (size_t k = 0; k < slots.size(); k++)
+        p._free.push(&slots[k]);
+    std::vector<pthread_t> stages(3 * threads);
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_create(&stages[3 * t], NULL, decode_stage, &p);
+        pthread_create(&stages[3 * t + 1], NULL, preprocess_stage, &p);
+        pthread_create(&stages[3 * t + 2], NULL, score_stage, &p);
+    }
+    for (size_t t = 0; t < stages.size(); t++)
+        pthread_join(stages[t], NULL);
+    v.add_counters(paths.size(), 0, 0);
+
     score_t sum = 0;
-    for (uint16_t i = 0; i < min(n1, n2); i++)
+    for (frame_t i = 0; i < min(n1, n2); i++)
     {
-        score_t frame_score = v.compute_frame_score(video1, video2, i, i);
-        printf("FrameScore: %3.2f\n", frame_score);
+        score_t frame_score = p._scores[pair_of[i]];
+        if (!options._quiet)
+            printf("FrameScore: %3.2f\n", frame_score);
         sum += frame_score;
     }
+    if (result)
+    {
+        // no alignment is searched, so the score is reported as is
+        result->set(max(n1, n2) - sum, max(n1, n2) - sum, max(n1, n2), n1, n2);
+        result->_expansions = min(n1, n2);
+    }
     return sum / max(n1, n2);
 }
-
-
@@ -0,0 +1,221 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Coarse-to-fine (multiresolution) edit distance DP algorithm.
+ *
+ * The videos are first aligned using every MULTIRES_STEP-th frame only. The path
+ * found is projected to twice the frame rate, widened by MULTIRES_RADIUS cells on
+ * each side, and the alignment is repeated within that corridor, down to the full
+ * frame rate. The number of frame scores grows linearly with the video length,
+ * but the path is only optimal within the final corridor.
+ */
+
+#include <vector>
+#include "vqats.hh"
+
+#define min(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b; })
+#define max(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b; })
+
+#ifndef MULTIRES_STEP
+    #define MULTIRES_STEP 8 // frame step at the coarsest level, a power of 2
+#endif
+#ifndef MULTIRES_RADIUS
+    #define MULTIRES_RADIUS 2 // cells added on each side of the projected path
+#endif
+
+struct CellData
+{
+    score_t _sum; // cumulative score
+    uint32_t _length; // path length
+    char _path; // which way to reverse: 0 = diagonal, 1 = decrease i1, 2 = decrease i2
+};
+
+// cells of row i1 span columns [_lo, _hi]
+struct Corridor
+{
+    std::vector<int> _lo, _hi;
+};
+
+// aligns frames 0, step, 2 * step, ... of both videos within the corridor. node (k1, k2) stands for
+// the first k1 * step and k2 * step frames. returns the nodes of the path found, from the end back.
+static std::vector<std::pair<int, int> > align_level(VQATS& v, const video_t& video1, const video_t& video2,
+                                                     const frame_t& n1, const frame_t& n2, int step,
+                                                     const Corridor& corridor, score_t& sum, uint32_t& length,
+                                                     unsigned long& cells_computed)
+{
+    int m1 = (n1 + step - 1) / step;
+    int m2 = (n2 + step - 1) / step;
+    std::vector<std::vector<CellData> > cells(m1 + 1);
+    for (int k1 = 0; k1 <= m1; k1++)
+    {
+        int lo = corridor._lo[k1], hi = corridor._hi[k1];
+        cells[k1].resize(hi - lo + 1);
+        cells_computed += hi - lo + 1;
+        for (int k2 = lo; k2 <= hi; k2++)
+        {
+            CellData& c = cells[k1][k2 - lo];
+            c._sum = INF;
+            c._length = 0;
+            c._path = 0;
+            if (k1 == 0 && k2 == 0)
+            {
+                c._sum = 0;
+                continue;
+            }
+            if (k1 > 0)
+            {
+                int plo = corridor._lo[k1 - 1], phi = corridor._hi[k1 - 1];
+                if (k2 > 0 && k2 - 1 >= plo && k2 - 1 <= phi)
+                {
+                    CellData& p = cells[k1 - 1][k2 - 1 - plo];
+                    score_t s = p._sum + 1.0 - v.compute_frame_score(video1, video2, (k1 - 1) * step, (k2 - 1) * step);
+                    if (s < c._sum)
+                    {
+                        c._sum = s;
+                        c._length = p._length + 1;
+                        c._path = 0;
+                    }
+                }
+                if (k2 >= plo && k2 <= phi)
+                {
+                    CellData& p = cells[k1 - 1][k2 - plo];
+                    if (p._sum + 1.0 - DELETED_FRAME < c._sum)
+                    {
+                        c._sum = p._sum + 1.0 - DELETED_FRAME;
+                        c._length = p._length + 1;
+                        c._path = 1;
+                    }
+                }
+            }
+            if (k2 > lo)
+            {
+                CellData& p = cells[k1][k2 - 1 - lo];
+                if (p._sum + 1.0 - INSERTED_FRAME < c._sum)
+                {
+                    c._sum = p._sum + 1.0 - INSERTED_FRAME;
+                    c._length = p._length + 1;
+                    c._path = 2;
+                }
+            }
+        }
+    }
+    sum = cells[m1][m2 - corridor._lo[m1]]._sum;
+    length = cells[m1][m2 - corridor._lo[m1]]._length;
+
+    // recover path
+    std::vector<std::pair<int, int> > path;
+    int k1 = m1, k2 = m2;
+    path.push_back(std::make_pair(k1, k2));
+    while (k1 > 0 || k2 > 0)
+    {
+        switch (cells[k1][k2 - corridor._lo[k1]]._path)
+        {
+            case 0: k1--; k2--; break;
+            case 1: k1--; break;
+            case 2: k2--; break;
+        }
+        path.push_back(std::make_pair(k1, k2));
+    }
+    return path;
+}
+
+// corridor at half the step around a path, widened by the radius
+static Corridor project(const std::vector<std::pair<int, int> >& path, int m1, int m2, int radius)
+{
+    Corridor narrow;
+    narrow._lo.assign(m1 + 1, m2);
+    narrow._hi.assign(m1 + 1, 0);
+    for (size_t k = 0; k + 1 < path.size(); k++)
+    {
+        // the move between two nodes covers every finer node between their projections
+        int a1 = min(2 * path[k + 1].first, m1), a2 = min(2 * path[k + 1].second, m2);
+        int b1 = min(2 * path[k].first, m1), b2 = min(2 * path[k].second, m2);
+        for (int k1 = a1; k1 <= b1; k1++)
+        {
+            narrow._lo[k1] = min(narrow._lo[k1], a2);
+            narrow._hi[k1] = max(narrow._hi[k1], b2);
+        }
+    }
+    Corridor wide;
+    wide._lo.resize(m1 + 1);
+    wide._hi.resize(m1 + 1);
+    for (int k1 = 0; k1 <= m1; k1++)
+    {
+        int lo = m2, hi = 0;
+        for (int j = max(0, k1 - radius); j <= min(m1, k1 + radius); j++)
+        {
+            lo = min(lo, narrow._lo[j]);
+            hi = max(hi, narrow._hi[j]);
+        }
+        wide._lo[k1] = max(0, lo - radius);
+        wide._hi[k1] = min(m2, hi + radius);
+    }
+    return wide;
+}
+
+// corridor that covers every cell
+static Corridor full_corridor(int m1, int m2)
+{
+    Corridor c;
+    c._lo.assign(m1 + 1, 0);
+    c._hi.assign(m1 + 1, m2);
+    return c;
+}
+
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options, SearchResult* result)
+{
+    frame_t n1 = v._video_map[video1]._frames.size();
+    frame_t n2 = v._video_map[video2]._frames.size();
+    int step = MULTIRES_STEP;
+    while (step > 1 && ((int)n1 < 2 * step || (int)n2 < 2 * step))
+        step /= 2; // too few frames to decimate this much
+
+    score_t sum = 0;
+    uint32_t length = 0;
+    unsigned long cells_computed = 0;
+    Corridor corridor = full_corridor((n1 + step - 1) / step, (n2 + step - 1) / step);
+    while (true)
+    {
+        std::vector<std::pair<int, int> > path = align_level(v, video1, video2, n1, n2, step, corridor, sum, length, cells_computed);
+#ifdef DEBUG
+        printf("Step = %d Sum = %f Length = %d Cells = %lu\n", step, sum, length, cells_computed);
+#endif
+        if (step == 1)
+            break;
+        step /= 2;
+        corridor = project(path, (n1 + step - 1) / step, (n2 + step - 1) / step, MULTIRES_RADIUS);
+    }
+
+#ifdef DEBUG
+    printf("Sum = %f\n",  sum);
+    printf("Length = %d\n", length);
+#endif
+
+    if (options._compare)
+    {
+        // the same DP over the whole grid, which is what algoD computes
+        score_t full_sum;
+        uint32_t full_length;
+        unsigned long full_cells = 0;
+        unsigned long frame_scores = v.frame_scores(), memo_lookups = v.memo_lookups(), memo_hits = v.memo_hits();
+        align_level(v, video1, video2, n1, n2, 1, full_corridor(n1, n2), full_sum, full_length, full_cells);
+        score_t full_score = 1.0 - full_sum / full_length;
+        printf("FullScore = %.4f\n", full_score);
+        printf("FullFrameScores = %lu\n", v.memo_lookups() - memo_lookups); // asked for, as some are in the memo already
+        // the frame scores reported are those of the coarse-to-fine search
+        v.reset_counters(frame_scores, memo_lookups, memo_hits);
+        printf("Deviation = %.4f\n", (1.0 - sum / length) - full_score);
+    }
+
+    if (result)
+    {
+        // the corridors may exclude the optimal path, so only the trivial lower bound holds
+        result->set(sum, 0, length, n1, n2);
+        result->_expansions = cells_computed;
+    }
+
+    return 1.0 - sum / length;
+}
+
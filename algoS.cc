@@ -0,0 +1,311 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Streaming alignment with bounded lag.
+ *
+ * Frames are consumed as they arrive. We run the edit distance DP over a band of
+ * diagonal offsets, one row per frame of the first video, and keep only the rows
+ * that are not yet committed. Once a row is `lag' rows behind the newest one, we
+ * trace back from the best cell of the newest row, the one whose path has the best
+ * running score, commit the cell where that path leaves the old row, and print the
+ * matches decided there. Memory is O(band * lag) regardless of the length of the
+ * streams.
+ */
+
+#include <climits>
+#include <vector>
+#include <deque>
+#include "vqats.hh"
+
+#define min(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b; })
+#define max(a,b) ({ typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b; })
+
+#define NO_SCORE (-INF) // diagonal score not computed yet
+
+struct CellData
+{
+    score_t _score; // score of the diagonal move into this cell
+    score_t _sum; // cumulative score
+    uint32_t _length; // path length
+    char _path; // which way to reverse: 0 = diagonal, 1 = decrease i1, 2 = decrease i2
+};
+
+struct RowData
+{
+    CellData& cell(int i2) { return _cells[i2 - _lo]; }
+    bool has(int i2) const { return i2 >= _lo && i2 < _lo + (int)_cells.size(); }
+    int hi() const { return _lo + _cells.size() - 1; }
+
+    int _lo; // first column of the band in this row
+    std::vector<CellData> _cells;
+};
+
+class StreamAligner
+{
+public:
+    StreamAligner(VQATS& v, const video_t& video1, const video_t& video2, const SearchOptions& options)
+        : _v(v), _video1(video1), _video2(video2), _band(options._band), _lag(options._lag), _quiet(options._quiet),
+          _first(0), _n2(0), _ended2(false), _sum(0), _length(0), _cells(0) { }
+
+    score_t run();
+    score_t sum() const { return _sum; }
+    uint32_t length() const { return _length; }
+    int n1() const { return _first; }
+    int n2() const { return _n2; }
+    unsigned long cells() const { return _cells; }
+
+private:
+    RowData& row(int i1) { return _rows[i1 - _first]; }
+    bool ensure_test(int i2); // makes frames of the second video available up to i2 - 1
+    void relax(int i1, bool scoring); // computes the cells of row i1 from the row above
+    void extend(int i1, int hi); // widens the last row up to column hi, with inserts only
+    int traceback(int from1, int from2, int to1); // column where the best path from (from1, from2) leaves row to1
+    int best_cell(int i1); // column of the cell of row i1 whose path has the lowest cost per move
+    void commit(int i2); // commits the oldest row at column i2
+    void emit(const char* action, int i1, int i2, score_t score);
+
+    VQATS& _v;
+    video_t _video1, _video2;
+    int _band, _lag;
+    bool _quiet; // whether actions are left out of the report
+    std::deque<RowData> _rows; // rows not yet committed, and the last committed one
+    int _first; // row index of _rows.front()
+    int _n2; // frames of the second video seen so far
+    bool _ended2; // whether the second video has ended
+    score_t _sum; // committed cumulative score
+    uint32_t _length; // committed path length
+    unsigned long _cells; // cells computed, not counting recomputations
+};
+
+bool
+StreamAligner::ensure_test(int i2)
+{
+    while (!_ended2 && _n2 < i2)
+    {
+        if (_v.stream_frame(_video2, _n2))
+            _n2++;
+        else
+            _ended2 = true;
+    }
+    return _n2 >= i2;
+}
+
+void
+StreamAligner::relax(int i1, bool scoring)
+{
+    RowData& r = row(i1);
+    for (int i2 = r._lo; i2 <= r.hi(); i2++)
+    {
+        CellData& c = r.cell(i2);
+        c._sum = INF;
+        c._length = 0;
+        c._path = 0;
+        if (i1 == 0 && i2 == 0)
+        {
+            c._sum = 0;
+            continue;
+        }
+        if (i1 > 0)
+        {
+            RowData& p = row(i1 - 1);
+            if (i2 > 0 && p.has(i2 - 1) && p.cell(i2 - 1)._sum < INF)
+            {
+                // only score the diagonal when its source is still reachable. the cell keeps its score, and
+                // the memo would keep the scores of released frames, so the memo is left out. the score is
+                // rounded as the memo rounds it, to match the other engines
+                if (c._score == NO_SCORE)
+                {
+                    assert(scoring);
+                    c._score = (float)_v.compute_ssim(_video1, _video2, i1 - 1, i2 - 1, -INF);
+                }
+                c._sum = p.cell(i2 - 1)._sum + 1.0 - c._score;
+                c._length = p.cell(i2 - 1)._length + 1;
+                c._path = 0;
+            }
+            if (p.has(i2) && p.cell(i2)._sum + 1.0 - DELETED_FRAME < c._sum)
+            {
+                c._sum = p.cell(i2)._sum + 1.0 - DELETED_FRAME;
+                c._length = p.cell(i2)._length + 1;
+                c._path = 1;
+            }
+        }
+        if (r.has(i2 - 1) && r.cell(i2 - 1)._sum + 1.0 - INSERTED_FRAME < c._sum)
+        {
+            c._sum = r.cell(i2 - 1)._sum + 1.0 - INSERTED_FRAME;
+            c._length = r.cell(i2 - 1)._length + 1;
+            c._path = 2;
+        }
+    }
+}
+
+void
+StreamAligner::extend(int i1, int hi)
+{
+    RowData& r = row(i1);
+    while (r.hi() < hi)
+    {
+        CellData& p = r._cells.back();
+        CellData c;
+        c._score = NO_SCORE;
+        c._sum = p._sum + 1.0 - INSERTED_FRAME;
+        c._length = p._length + 1;
+        c._path = 2;
+        r._cells.push_back(c);
+    }
+}
+
+int
+StreamAligner::traceback(int from1, int from2, int to1)
+{
+    int i1 = from1, i2 = from2;
+    while (i1 > to1)
+    {
+        switch (row(i1).cell(i2)._path)
+        {
+            case 0: i1--; i2--; break;
+            case 1: i1--; break;
+            case 2: i2--; break;
+        }
+    }
+    return i2;
+}
+
+int
+StreamAligner::best_cell(int i1)
+{
+    // the last cell is always reachable, by inserts, and is kept on ties
+    RowData& r = row(i1);
+    int best = r.hi();
+    for (int i2 = r.hi() - 1; i2 >= r._lo; i2--)
+    {
+        CellData& c = r.cell(i2);
+        CellData& b = r.cell(best);
+        if (c._sum < INF && c._length > 0 && c._sum * b._length < b._sum * c._length)
+            best = i2;
+    }
+    return best;
+}
+
+void
+StreamAligner::emit(const char* action, int i1, int i2, score_t score)
+{
+    _sum += 1.0 - score;
+    _length++;
+    if (!_quiet)
+        printf("Action = %s Frame = %d %d Score = %f Running = %.4f\n", action, i1, i2, score, 1.0 - _sum / _length);
+}
+
+void
+StreamAligner::commit(int i2)
+{
+    // print the moves that enter the committed row and run along it up to column i2
+    int i1 = _first + 1;
+    RowData& r = row(i1);
+    std::vector<int> columns;
+    int c2 = i2;
+    while (r.cell(c2)._path == 2)
+        columns.push_back(c2--);
+    if (i1 == 1)
+    {
+        // row 0 is never committed on its own, so print the inserts that lead along it
+        int from2 = r.cell(c2)._path == 0 ? c2 - 1 : c2;
+        for (int k = 1; k <= from2; k++)
+            emit("INSERTED", -1, k - 1, INSERTED_FRAME);
+    }
+    if (r.cell(c2)._path == 0)
+        emit("MATCH   ", i1 - 1, c2 - 1, r.cell(c2)._score);
+    else
+        emit("DELETED ", i1 - 1, -1, DELETED_FRAME);
+    for (int k = columns.size() - 1; k >= 0; k--)
+        emit("INSERTED", -1, columns[k] - 1, INSERTED_FRAME);
+
+    // every later path must go through the committed cell: drop the row above and
+    // recompute the uncommitted rows from this one, without scoring any new frames
+    _rows.pop_front();
+    _first++;
+    for (int k = r._lo; k <= r.hi(); k++)
+        if (k != i2)
+            r.cell(k)._sum = INF;
+    for (int k = _first + 1; k < _first + (int)_rows.size(); k++)
+        relax(k, false);
+
+    // scores of the rows held are stored, so new rows only need frames from the newest row on
+    _v.release_frames(_video1, _first + _rows.size() - 1);
+    _v.release_frames(_video2, min(_n2, max(0, _rows.back()._lo - 1)));
+    fflush(stdout);
+}
+
+score_t
+StreamAligner::run()
+{
+    // row 0 inserts the first frames of the second video
+    ensure_test(_band);
+    RowData first;
+    first._lo = 0;
+    CellData start;
+    start._score = NO_SCORE;
+    start._sum = 0;
+    start._length = 0;
+    start._path = 0;
+    first._cells.push_back(start);
+    _rows.push_back(first);
+    extend(0, min(_band, _n2));
+
+    int i1 = 0;
+    while (_v.stream_frame(_video1, i1))
+    {
+        i1++;
+        ensure_test(i1 + _band);
+        RowData r;
+        r._lo = max(0, i1 - _band);
+        if (_ended2) r._lo = min(r._lo, _n2); // keep deleting once the second video has ended
+        CellData c;
+        c._score = NO_SCORE;
+        r._cells.assign(min(i1 + _band, _n2) - r._lo + 1, c);
+        _rows.push_back(r);
+        relax(i1, true);
+        _cells += _rows.back()._cells.size();
+
+        if (i1 - _first > _lag)
+        {
+            // commit the oldest uncommitted row along the path into the best cell of the newest row
+            commit(traceback(i1, best_cell(i1), _first + 1));
+        }
+    }
+
+    // the first video has ended, so finish at the last frame of the second
+    ensure_test(INT_MAX);
+    extend(i1, _n2);
+    while (_first < i1)
+        commit(traceback(i1, _n2, _first + 1));
+    if (i1 == 0)
+    {
+        // an empty first video: every frame of the second is inserted
+        for (int k = 0; k < _n2; k++)
+            emit("INSERTED", -1, k, INSERTED_FRAME);
+        fflush(stdout);
+    }
+    return _length > 0 ? 1.0 - _sum / _length : 1.0; // two empty videos are the same
+}
+
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options, SearchResult* result)
+{
+    StreamAligner aligner(v, video1, video2, options);
+    score_t score = aligner.run();
+
+#ifdef DEBUG
+    printf("Sum = %f\n",  aligner.sum());
+    printf("Length = %d\n", aligner.length());
+#endif
+
+    if (result)
+    {
+        // the band and the forced commits make this a heuristic, so only the trivial lower bound holds
+        result->set(aligner.sum(), 0, aligner.length(), aligner.n1(), aligner.n2());
+        result->_expansions = aligner.cells();
+    }
+    return score;
+}
+
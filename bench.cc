@@ -0,0 +1,75 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Benchmark of the per-frame work of loading a frame, at common resolutions.
+ * Each line gives the milliseconds per frame of converting a decoded frame with
+ * opencv, through an 8-bit YCrCb image and a fresh float image as frames were
+ * loaded before, and with the fused conversion into the reused planes of a frame
+ * buffer, and checks that both give the same values.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vqats.hh"
+
+#ifndef BENCH_PIXELS
+    #define BENCH_PIXELS 50000000 // pixels converted for each resolution and method
+#endif
+
+static double convert_opencv(const IplImage* bgr, IplImage** out, int rounds)
+{
+    double start = wall_time();
+    for (int i = 0; i < rounds; i++)
+    {
+        CvSize size = cvSize(bgr->width, bgr->height);
+        IplImage* temp = cvCreateImage(size, bgr->depth, bgr->nChannels);
+        cvCvtColor(bgr, temp, CV_BGR2YCrCb);
+        if (*out != NULL) cvReleaseImage(out);
+        *out = cvCreateImage(size, IPL_DEPTH_32F, bgr->nChannels);
+        cvConvert(temp, *out);
+        cvReleaseImage(&temp);
+    }
+    return (wall_time() - start) * 1000 / rounds;
+}
+
+static double convert_fused(const IplImage* bgr, FrameBuffer& out, int rounds)
+{
+    double start = wall_time();
+    for (int i = 0; i < rounds; i++)
+        convert_ycrcb(bgr, out);
+    return (wall_time() - start) * 1000 / rounds;
+}
+
+int main(int argc, char** argv)
+{
+    static const int sizes[][2] = { { 176, 144 }, { 352, 288 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    srand(1);
+    bool same = true;
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        CvSize size = cvSize(sizes[k][0], sizes[k][1]);
+        int rounds = BENCH_PIXELS / (size.width * size.height) + 1;
+        IplImage* bgr = cvCreateImage(size, IPL_DEPTH_8U, 3);
+        for (int i = 0; i < bgr->imageSize; i++)
+            bgr->imageData[i] = rand() & 0xff;
+        IplImage* expected = NULL;
+        FrameBuffer actual;
+        actual.create(size.width, size.height, 3);
+        double before = convert_opencv(bgr, &expected, rounds);
+        double after = convert_fused(bgr, actual, rounds);
+        for (int y = 0; y < size.height; y++)
+        {
+            const float* row = (const float*)(expected->imageData + y * expected->widthStep);
+            for (int x = 0; x < size.width; x++)
+                for (int c = 0; c < 3; c++)
+                    if (row[x * 3 + c] != actual.row(c, y)[x])
+                        same = false;
+        }
+        printf("Resolution = %dx%d %.3f %.3f ms (%.2fx)\n", size.width, size.height, before, after, before / after);
+        cvReleaseImage(&expected);
+        cvReleaseImage(&bgr);
+    }
+    printf("Same = %s\n", same ? "yes" : "no");
+    return same ? 0 : 1;
+}
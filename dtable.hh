@@ -1,8 +1,11 @@
+#ifndef DTABLE_HH
+#define DTABLE_HH
+
 template<class T>
 T** new_table(int n1, int n2)
 {
     T** table = new T*[n1];
-    for (uint16_t i1 = 0; i1 < n1; i1++)
+    for (int i1 = 0; i1 < n1; i1++)
         table[i1] = new T[n2];
     return table;
 }
@@ -11,10 +14,10 @@ template<class T>
 T** new_table(int n1, int n2, T initial)
 {
     T** table = new T*[n1];
-    for (uint16_t i1 = 0; i1 < n1; i1++)
+    for (int i1 = 0; i1 < n1; i1++)
     {
         table[i1] = new T[n2];
-        for (uint16_t i2 = 0; i2 < n2; i2++)
+        for (int i2 = 0; i2 < n2; i2++)
             table[i1][i2] = initial;
     }
     return table;
@@ -23,8 +26,132 @@ T** new_table(int n1, int n2, T initial)
 template<class T>
 void delete_table(T** table, int n1, int n2)
 {
-    for (uint16_t i = 0; i < n1; i++)
+    for (int i = 0; i < n1; i++)
         delete[] table[i];
     delete[] table;
 }
 
+
+// Sparse (i1, i2) table backed by an open-addressed hash with linear probing.
+// Memory grows with the number of cells actually touched rather than with n1*n2.
+// References returned by insert() are invalidated by the next insert().
+template<class T>
+class SparseTable
+{
+public:
+    SparseTable(const T& initial = T(), size_t capacity = 1024)
+        : _initial(initial), _capacity(1), _bits(0), _size(0)
+    {
+        while (_capacity < capacity) { _capacity <<= 1; _bits++; }
+        allocate();
+    }
+    ~SparseTable() { delete[] _keys; delete[] _values; }
+
+    // returns the cell, or NULL if it was never inserted
+    T* find(uint32_t i1, uint32_t i2)
+    {
+        uint64_t key = make_key(i1, i2);
+        for (size_t k = slot(key); _keys[k] != EMPTY; k = (k + 1) & (_capacity - 1))
+            if (_keys[k] == key)
+                return &_values[k];
+        return NULL;
+    }
+
+    // returns the cell, inserting it with the initial value if needed
+    T& insert(uint32_t i1, uint32_t i2)
+    {
+        uint64_t key = make_key(i1, i2);
+        size_t k = slot(key);
+        for (; _keys[k] != EMPTY; k = (k + 1) & (_capacity - 1))
+            if (_keys[k] == key)
+                return _values[k];
+        if ((_size + 1) * 4 > _capacity * 3) // keep load factor under 0.75
+        {
+            grow();
+            return insert(i1, i2);
+        }
+        _size++;
+        _keys[k] = key;
+        _values[k] = _initial;
+        return _values[k];
+    }
+
+    // raw slot access, for walking over every inserted cell
+    size_t capacity() const { return _capacity; }
+    bool used(size_t k) const { return _keys[k] != EMPTY; }
+    T& value(size_t k) { return _values[k]; }
+
+    size_t size() const { return _size; }
+    size_t bytes() const { return _capacity * (sizeof(uint64_t) + sizeof(T)); }
+
+private:
+    static const uint64_t EMPTY = ~0ULL;
+
+    static uint64_t make_key(uint32_t i1, uint32_t i2) { return ((uint64_t)i1 << 32) | i2; }
+    size_t slot(uint64_t key) const { return _bits == 0 ? 0 : (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - _bits)); } // fibonacci hashing
+
+    void allocate()
+    {
+        _keys = new uint64_t[_capacity];
+        _values = new T[_capacity];
+        for (size_t k = 0; k < _capacity; k++)
+            _keys[k] = EMPTY;
+    }
+
+    void grow()
+    {
+        uint64_t* keys = _keys;
+        T* values = _values;
+        size_t capacity = _capacity;
+        _capacity <<= 1;
+        _bits++;
+        allocate();
+        for (size_t j = 0; j < capacity; j++)
+        {
+            if (keys[j] == EMPTY) continue;
+            size_t k = slot(keys[j]);
+            while (_keys[k] != EMPTY) k = (k + 1) & (_capacity - 1);
+            _keys[k] = keys[j];
+            _values[k] = values[j];
+        }
+        delete[] keys;
+        delete[] values;
+    }
+
+    T _initial;
+    uint64_t* _keys;
+    T* _values;
+    size_t _capacity, _bits, _size;
+
+    SparseTable(const SparseTable&);
+    SparseTable& operator=(const SparseTable&);
+};
+
+
+// Dense (i1, i2) table of 2-bit values, packed four to a byte.
+// Used for backpointers, which need a quarter of a byte each instead of a full cell.
+class PackedTable
+{
+public:
+    PackedTable(size_t n1, size_t n2) : _n2(n2), _bytes((n1 * n2 + 3) / 4, 0) { }
+
+    unsigned get(size_t i1, size_t i2) const
+    {
+        size_t k = i1 * _n2 + i2;
+        return (_bytes[k >> 2] >> ((k & 3) * 2)) & 3;
+    }
+
+    void set(size_t i1, size_t i2, unsigned value)
+    {
+        size_t k = i1 * _n2 + i2;
+        _bytes[k >> 2] = (_bytes[k >> 2] & ~(3 << ((k & 3) * 2))) | (value << ((k & 3) * 2));
+    }
+
+    size_t bytes() const { return _bytes.size(); }
+
+private:
+    size_t _n2;
+    std::vector<unsigned char> _bytes;
+};
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Fast path for videos that need little or no alignment.
+ *
+ * The straight diagonal path is scored first, with frame pairs that are bit for
+ * bit identical taken as a perfect match without computing their SSIM. Any other
+ * path inserts as many frames as it deletes, so a path that strays more than w
+ * frames off the diagonal costs at least 2 (w + 1). Once that is more than the
+ * cost of the diagonal, the optimal path lies within w frames of the diagonal,
+ * and a DP over that band finds it. When the diagonal is nearly perfect the band
+ * is the diagonal alone, and no search is made at all.
+ */
+
+#include <stdio.h>
+#include <vector>
+#include "vqats.hh"
+
+#ifndef FAST_MAX_BAND
+    #define FAST_MAX_BAND 64 // widest band searched, in frames on each side of the diagonal
+#endif
+
+struct CellData
+{
+    score_t _sum; // cumulative score
+    uint32_t _length; // path length
+};
+
+bool compute_fast_score(VQATS& v, const video_t& video1, const video_t& video2,
+                        const SearchOptions& options, score_t& score, SearchResult* result)
+{
+    VideoData& data1 = v._video_map[video1];
+    VideoData& data2 = v._video_map[video2];
+    int n = data1._frames.size();
+    if ((int)data2._frames.size() != n || n == 0)
+    {
+        printf("FastPath = none\n");
+        return false;
+    }
+
+    // score the diagonal. frames stay identical as long as their content hashes match and their pixels are
+    // then the same, which is checked until the first pair that differs, so that videos that differ throughout
+    // are not fingerprinted.
+    std::vector<score_t> diagonal(n);
+    score_t diagonal_sum = 0;
+    bool identical = true;
+    for (int i = 0; i < n; i++)
+    {
+        identical = identical && data1.frame(i).fingerprint() && data2.frame(i).fingerprint() &&
+            data1.frame(i)._content == data2.frame(i)._content;
+        if (identical)
+        {
+            // a hash may collide, so the pixels decide
+            FrameHandle handle1 = v.acquire_frame(video1, i);
+            FrameHandle handle2 = v.acquire_frame(video2, i);
+            identical = handle1.loaded() && handle2.loaded() && handle1->identical(*handle2);
+            if (identical)
+                __sync_fetch_and_add(&v._identical_scores, 1);
+        }
+        diagonal[i] = 1.0 - (identical ? 1.0 : v.compute_frame_score(video1, video2, i, i));
+        diagonal_sum += diagonal[i];
+    }
+
+    // paths that stray more than band frames off the diagonal cost at least as much as the diagonal
+    int band = 0;
+    while (2.0 * (band + 1) < diagonal_sum)
+        band++;
+    if (band > FAST_MAX_BAND || 2 * band + 1 >= n)
+    {
+        printf("FastPath = none\n");
+        return false;
+    }
+
+    // DP over the band. cell d of a row is at offset d - band from the diagonal. a match that cannot make a
+    // path cheaper than the diagonal is given up early, as at least the offset is still to pay after it.
+    int width = 2 * band + 1;
+    std::vector<CellData> prev(width), cells(width);
+    unsigned long cells_computed = 0;
+    for (int d = 0; d < width; d++)
+    {
+        cells[d]._sum = d < band ? INF : d - band;
+        cells[d]._length = d < band ? 0 : d - band;
+    }
+    for (int i1 = 1; i1 <= n; i1++)
+    {
+        prev.swap(cells);
+        for (int d = 0; d < width; d++)
+        {
+            int i2 = i1 + d - band;
+            CellData& c = cells[d];
+            c._sum = INF;
+            c._length = 0;
+            if (i2 < 0 || i2 > n)
+                continue;
+            cells_computed++;
+            if (i2 > 0 && prev[d]._sum < INF)
+            {
+                int offset = d > band ? d - band : band - d;
+                score_t cost = d == band ? diagonal[i1 - 1] :
+                    1.0 - v.compute_frame_score(video1, video2, i1 - 1, i2 - 1, 1.0 - (diagonal_sum - prev[d]._sum - offset));
+                c._sum = prev[d]._sum + cost;
+                c._length = prev[d]._length + 1;
+            }
+            if (d + 1 < width && prev[d + 1]._sum + 1.0 - DELETED_FRAME < c._sum)
+            {
+                c._sum = prev[d + 1]._sum + 1.0 - DELETED_FRAME;
+                c._length = prev[d + 1]._length + 1;
+            }
+            if (d > 0 && i2 > 0 && cells[d - 1]._sum + 1.0 - INSERTED_FRAME < c._sum)
+            {
+                c._sum = cells[d - 1]._sum + 1.0 - INSERTED_FRAME;
+                c._length = cells[d - 1]._length + 1;
+            }
+        }
+    }
+    score_t sum = cells[band]._sum;
+    uint32_t length = cells[band]._length;
+    printf("FastPath = band %d\n", band);
+
+#ifdef DEBUG
+    printf("Diagonal = %f\n", diagonal_sum);
+    printf("Sum = %f\n", sum);
+    printf("Length = %d\n", length);
+#endif
+
+    if (result)
+    {
+        result->set(sum, sum, length, n, n); // the path is optimal
+        result->_expansions = cells_computed;
+    }
+    score = 1.0 - sum / length;
+    return true;
+}
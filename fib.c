@@ -106,6 +106,9 @@ fh_initheap(struct fibheap *new)
 	new->fh_min = NULL;
 	new->fh_root = NULL;
 	new->fh_keys = 0;
+	new->fh_chunks = NULL;
+	new->fh_free = NULL;
+	new->fh_nused = FH_CHUNK;
 #ifdef FH_STATS
 	new->fh_maxn = 0;
 	new->fh_ninserts = 0;
@@ -116,14 +119,48 @@ fh_initheap(struct fibheap *new)
 static void
 fh_destroyheap(struct fibheap *h)
 {
+	struct fibheap_chunk *c;
+
 	h->fh_cmp_fnct = NULL;
 	h->fh_neginf = NULL;
 	if (h->fh_cons != NULL)
 		free(h->fh_cons);
 	h->fh_cons = NULL;
+	while ((c = h->fh_chunks) != NULL) {
+		h->fh_chunks = c->fhc_next;
+		free(c);
+	}
 	free(h);
 }
 
+/*
+ * move all element storage of hb over to ha, so that elements of hb stay
+ * valid once hb is destroyed.
+ */
+static void
+fh_takechunks(struct fibheap *ha, struct fibheap *hb)
+{
+	struct fibheap_chunk *c;
+	struct fibheap_el *x;
+
+	if ((c = hb->fh_chunks) != NULL) {
+		while (c->fhc_next != NULL)
+			c = c->fhc_next;
+		c->fhc_next = ha->fh_chunks;
+		ha->fh_chunks = hb->fh_chunks;
+		/* hb's newest chunk is now ours; the tail of our old one is lost */
+		ha->fh_nused = hb->fh_nused;
+		hb->fh_chunks = NULL;
+	}
+	if ((x = hb->fh_free) != NULL) {
+		while (x->fhe_right != NULL)
+			x = x->fhe_right;
+		x->fhe_right = ha->fh_free;
+		ha->fh_free = hb->fh_free;
+		hb->fh_free = NULL;
+	}
+}
+
 /*
  * Public Heap Functions
  */
@@ -184,9 +221,11 @@ fh_union(struct fibheap *ha, struct fibheap *hb)
 	if (ha->fh_root == NULL || hb->fh_root == NULL) {
 		/* either one or both are empty */
 		if (ha->fh_root == NULL) {
+			fh_takechunks(hb, ha);
 			fh_destroyheap(ha);
 			return hb;
 		} else {
+			fh_takechunks(ha, hb);
 			fh_destroyheap(hb);
 			return ha;
 		}
@@ -205,6 +244,7 @@ fh_union(struct fibheap *ha, struct fibheap *hb)
 	if (fh_compare(ha, hb->fh_min, ha->fh_min) < 0)
 		ha->fh_min = hb->fh_min;
 
+	fh_takechunks(ha, hb);
 	fh_destroyheap(hb);
 	return ha;
 }
@@ -213,12 +253,9 @@ void
 fh_deleteheap(struct fibheap *h)
 {
 	/*
-	 * We could do this even faster by walking each binomial tree, but
-	 * this is simpler to code.
+	 * all elements live in the heap's chunks, which are released in bulk,
+	 * so there is no need to walk the trees.
 	 */
-	while (h->fh_min != NULL)
-		fhe_destroy(fh_extractminel(h));
-
 	fh_destroyheap(h);
 }
 
@@ -230,7 +267,7 @@ fh_insertkey(struct fibheap *h, int key, void *data)
 {
 	struct fibheap_el *x;
 
-	if ((x = fhe_newelem()) == NULL)
+	if ((x = fhe_newelem(h)) == NULL)
 		return NULL;
 
 	/* just insert on root list, and make sure it's not the new min */
@@ -329,7 +366,7 @@ fh_insert(struct fibheap *h, void *data)
 {
 	struct fibheap_el *x;
 
-	if ((x = fhe_newelem()) == NULL)
+	if ((x = fhe_newelem(h)) == NULL)
 		return NULL;
 
 	/* just insert on root list, and make sure it's not the new min */
@@ -360,7 +397,7 @@ fh_extractmin(struct fibheap *h)
 		z = fh_extractminel(h);
 		ret = z->fhe_data;
 #ifndef NO_FREE
-		fhe_destroy(z);
+		fhe_destroy(h, z);
 #endif
 
 	}
@@ -393,19 +430,19 @@ fh_delete(struct fibheap *h, struct fibheap_el *x)
  * Statistics Functions
  */
 #ifdef FH_STATS
-int
+long
 fh_maxn(struct fibheap *h)
 {
 	return h->fh_maxn;
 }
 
-int
+long
 fh_ninserts(struct fibheap *h)
 {
 	return h->fh_ninserts;
 }
 
-int
+long
 fh_nextracts(struct fibheap *h)
 {
 	return h->fh_nextracts;
@@ -563,18 +600,37 @@ fh_cascading_cut(struct fibheap *h, struct fibheap_el *y)
  * begining of handling elements of fibheap
  */
 static struct fibheap_el *
-fhe_newelem()
+fhe_newelem(struct fibheap *h)
 {
 	struct fibheap_el *e;
+	struct fibheap_chunk *c;
 
-	if ((e = malloc(sizeof *e)) == NULL)
-		return NULL;
+	if ((e = h->fh_free) != NULL)
+		h->fh_free = e->fhe_right;
+	else {
+		if (h->fh_nused == FH_CHUNK) {
+			if ((c = malloc(sizeof *c)) == NULL)
+				return NULL;
+			c->fhc_next = h->fh_chunks;
+			h->fh_chunks = c;
+			h->fh_nused = 0;
+		}
+		e = &h->fh_chunks->fhc_els[h->fh_nused++];
+	}
 
 	fhe_initelem(e);
 
 	return e;
 }
 
+static void
+fhe_destroy(struct fibheap *h, struct fibheap_el *e)
+{
+	/* the free list is threaded through fhe_right */
+	e->fhe_right = h->fh_free;
+	h->fh_free = e;
+}
+
 static void
 fhe_initelem(struct fibheap_el *e)
 {
@@ -60,9 +60,9 @@ void fh_deleteheap(struct fibheap *);
 struct fibheap *fh_union(struct fibheap *, struct fibheap *);
 
 #ifdef FH_STATS
-int fh_maxn(struct fibheap *);
-int fh_ninserts(struct fibheap *);
-int fh_nextracts(struct fibheap *);
+long fh_maxn(struct fibheap *);
+long fh_ninserts(struct fibheap *);
+long fh_nextracts(struct fibheap *);
 #endif
 
 #ifdef __cplusplus
@@ -35,6 +35,7 @@ extern "C" {
 #endif
 
 struct fibheap_el;
+struct fibheap_chunk;
 
 /*
  * global heap operations
@@ -48,10 +49,13 @@ struct fibheap {
 	struct	fibheap_el *fh_root;
 	void	*fh_neginf;
 	int	fh_keys		: 1;
+	struct	fibheap_chunk *fh_chunks;	/* element storage */
+	struct	fibheap_el *fh_free;		/* recycled elements */
+	int	fh_nused;			/* elements used in newest chunk */
 #ifdef FH_STATS
-	int	fh_maxn;
-	int	fh_ninserts;
-	int	fh_nextracts;
+	long	fh_maxn;
+	long	fh_ninserts;
+	long	fh_nextracts;
 #endif
 };
 
@@ -66,6 +70,7 @@ static void fh_cascading_cut(struct fibheap *, struct fibheap_el *);
 static struct fibheap_el *fh_extractminel(struct fibheap *);
 static void fh_checkcons(struct fibheap *h);
 static void fh_destroyheap(struct fibheap *h);
+static void fh_takechunks(struct fibheap *ha, struct fibheap *hb);
 static int fh_compare(struct fibheap *h, struct fibheap_el *a,
 			struct fibheap_el *b);
 static int fh_comparedata(struct fibheap *h, int key, void *data,
@@ -87,12 +92,25 @@ struct fibheap_el {
 	void	*fhe_data;
 };
 
-static struct fibheap_el *fhe_newelem(void);
+static struct fibheap_el *fhe_newelem(struct fibheap *);
 static void fhe_initelem(struct fibheap_el *);
 static void fhe_insertafter(struct fibheap_el *a, struct fibheap_el *b);
 static inline void fhe_insertbefore(struct fibheap_el *a, struct fibheap_el *b);
 static struct fibheap_el *fhe_remove(struct fibheap_el *a);
-#define	fhe_destroy(x)	free((x))
+static void fhe_destroy(struct fibheap *, struct fibheap_el *);
+
+/*
+ * elements are carved out of per-heap chunks and recycled through a free
+ * list, so that the chunks can all be released when the heap is deleted.
+ */
+#ifndef FH_CHUNK
+#define	FH_CHUNK	1024
+#endif
+
+struct fibheap_chunk {
+	struct	fibheap_chunk *fhc_next;
+	struct	fibheap_el fhc_els[FH_CHUNK];
+};
 
 /*
  * general functions
@@ -0,0 +1,190 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Free-list allocator for search nodes. Objects are carved out of large chunks
+ * and recycled through a free list; all chunks are released at once when the
+ * pool goes out of scope, so no per-node cleanup is needed at the end of a search.
+ *
+ * Buffer pool for frame images, which are recycled by size class, so that frames
+ * loaded in place of evicted ones take over their memory.
+ */
+
+#ifndef _POOL_HH_
+#define _POOL_HH_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <map>
+#include <vector>
+#include <new>
+
+#ifndef POOL_CHUNK
+    #define POOL_CHUNK 4096 // number of objects allocated at a time
+#endif
+
+#ifndef BUFFER_POOL_BYTES
+    #define BUFFER_POOL_BYTES (256 << 20) // most bytes of free buffers kept for reuse
+#endif
+
+#define SMALL_PAGE (4 << 10)
+#define HUGE_PAGE (2 << 20)
+
+template<class T>
+class Pool
+{
+public:
+    Pool(): _chunks(NULL), _free(NULL), _next(POOL_CHUNK), _nchunks(0) { }
+    ~Pool() { clear(); }
+
+    // returns raw storage for one object, to be constructed with placement new.
+    // objects are never destructed, so T must not own any resources.
+    void* alloc()
+    {
+        if (_free != NULL)
+        {
+            Slot* slot = _free;
+            _free = slot->_next;
+            return slot;
+        }
+        if (_next == POOL_CHUNK)
+        {
+            Chunk* chunk = (Chunk*)malloc(sizeof(Chunk));
+            if (chunk == NULL)
+                throw std::bad_alloc();
+            chunk->_next = _chunks;
+            _chunks = chunk;
+            _next = 0;
+            _nchunks++;
+        }
+        return &_chunks->_slots[_next++];
+    }
+
+    // returns an object to the free list for reuse within this pool
+    void free(T* p)
+    {
+        Slot* slot = (Slot*)p;
+        slot->_next = _free;
+        _free = slot;
+    }
+
+    // releases every chunk at once
+    void clear()
+    {
+        while (_chunks != NULL)
+        {
+            Chunk* chunk = _chunks;
+            _chunks = chunk->_next;
+            ::free(chunk);
+        }
+        _free = NULL;
+        _next = POOL_CHUNK;
+        _nchunks = 0;
+    }
+
+    size_t bytes() const { return _nchunks * sizeof(Chunk); } // memory held by this pool
+
+private:
+    union Slot
+    {
+        Slot* _next;
+        double _align;
+        char _data[sizeof(T)];
+    };
+    struct Chunk
+    {
+        Chunk* _next;
+        Slot _slots[POOL_CHUNK];
+    };
+
+    Chunk* _chunks; // list of allocated chunks, most recent first
+    Slot* _free; // free list of recycled slots
+    size_t _next; // next unused slot in the most recent chunk
+    size_t _nchunks;
+
+    Pool(const Pool&);
+    Pool& operator=(const Pool&);
+};
+
+// buffers are mapped in whole pages, and buffers of a huge page or more in whole huge pages aligned to them, so
+// that the kernel can back them with huge pages. a freed buffer is kept for the next buffer of its size class
+// until BUFFER_POOL_BYTES of them are kept. thread-safe.
+class BufferPool
+{
+public:
+    BufferPool() : _kept(0), _maps(0) { pthread_mutex_init(&_lock, NULL); }
+
+    void* alloc(size_t bytes)
+    {
+        size_t size = size_class(bytes);
+        void* p = NULL;
+        pthread_mutex_lock(&_lock);
+        std::vector<void*>& kept = _free[size];
+        if (!kept.empty())
+        {
+            p = kept.back();
+            kept.pop_back();
+            _kept -= size;
+        }
+        pthread_mutex_unlock(&_lock);
+        return p != NULL ? p : map(size);
+    }
+
+    void free(void* p, size_t bytes)
+    {
+        size_t size = size_class(bytes);
+        pthread_mutex_lock(&_lock);
+        bool keep = _kept + size <= BUFFER_POOL_BYTES;
+        if (keep)
+        {
+            _free[size].push_back(p);
+            _kept += size;
+        }
+        pthread_mutex_unlock(&_lock);
+        if (!keep)
+            munmap(p, size);
+    }
+
+    unsigned long maps() const { return _maps; } // number of buffers mapped from the system so far
+
+private:
+    static size_t size_class(size_t bytes)
+    {
+        size_t page = bytes >= HUGE_PAGE ? HUGE_PAGE : SMALL_PAGE;
+        return (bytes + page - 1) / page * page;
+    }
+
+    void* map(size_t size)
+    {
+        // a huge page sized buffer is cut out of a mapping one huge page longer, at a huge page boundary
+        size_t extra = size >= HUGE_PAGE ? HUGE_PAGE : 0;
+        char* p = (char*)mmap(NULL, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+        if (extra > 0)
+        {
+            size_t head = (HUGE_PAGE - (uintptr_t)p % HUGE_PAGE) % HUGE_PAGE;
+            if (head > 0)
+                munmap(p, head);
+            munmap(p + head + size, extra - head);
+            p += head;
+#ifdef MADV_HUGEPAGE
+            madvise(p, size, MADV_HUGEPAGE);
+#endif
+        }
+        __sync_fetch_and_add(&_maps, 1);
+        return p;
+    }
+
+    std::map<size_t, std::vector<void*> > _free; // kept buffers by size class
+    size_t _kept; // bytes of kept buffers
+    volatile unsigned long _maps;
+    pthread_mutex_t _lock;
+
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+};
+
+#endif /* _POOL_HH_ */
@@ -0,0 +1,159 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * See header file for a description.
+ *
+ * Owners take tasks from the back of their deque, so a worker keeps on with the
+ * tasks it spawned last, whose frames are the ones it has loaded, and thieves take
+ * from the front, the oldest and usually largest tasks. Idle threads sleep until
+ * a task is spawned or a group they wait for finishes.
+ */
+
+#include "sched.hh"
+
+static __thread Scheduler* current_scheduler = NULL; // scheduler of the worker running on this thread
+static __thread int current_worker = 0;
+
+struct WorkerStart
+{
+    Scheduler* _scheduler;
+    int _index;
+};
+
+Scheduler::Scheduler(int threads)
+    : _queued(0), _spawns(0), _stop(false), _steals(0)
+{
+    pthread_mutex_init(&_idle_lock, NULL);
+    pthread_cond_init(&_idle, NULL);
+    _workers.resize(threads + 1);
+    for (size_t k = 0; k < _workers.size(); k++)
+    {
+        _workers[k] = new Worker();
+        pthread_mutex_init(&_workers[k]->_lock, NULL);
+    }
+    _threads.resize(threads);
+    for (int t = 0; t < threads; t++)
+    {
+        WorkerStart* start = new WorkerStart();
+        start->_scheduler = this;
+        start->_index = t;
+        pthread_create(&_threads[t], NULL, worker_main, start);
+    }
+}
+
+Scheduler::~Scheduler()
+{
+    pthread_mutex_lock(&_idle_lock);
+    _stop = true;
+    pthread_cond_broadcast(&_idle);
+    pthread_mutex_unlock(&_idle_lock);
+    for (size_t t = 0; t < _threads.size(); t++)
+        pthread_join(_threads[t], NULL);
+    for (size_t k = 0; k < _workers.size(); k++)
+    {
+        pthread_mutex_destroy(&_workers[k]->_lock);
+        delete _workers[k];
+    }
+    pthread_cond_destroy(&_idle);
+    pthread_mutex_destroy(&_idle_lock);
+}
+
+void* Scheduler::worker_main(void* arg)
+{
+    WorkerStart* start = (WorkerStart*)arg;
+    Scheduler* s = start->_scheduler;
+    current_scheduler = s;
+    current_worker = start->_index;
+    delete start;
+    while (true)
+    {
+        if (s->run_task(current_worker, NULL))
+            continue;
+        pthread_mutex_lock(&s->_idle_lock);
+        while (s->_queued == 0 && !s->_stop)
+            pthread_cond_wait(&s->_idle, &s->_idle_lock);
+        bool stop = s->_queued == 0 && s->_stop;
+        pthread_mutex_unlock(&s->_idle_lock);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+void Scheduler::spawn(TaskGroup& group, task_fn fn, void* arg)
+{
+    Task task;
+    task._fn = fn;
+    task._arg = arg;
+    task._group = &group;
+    __sync_fetch_and_add(&group._pending, 1);
+    Worker* w = _workers[current_scheduler == this ? current_worker : _threads.size()];
+    pthread_mutex_lock(&w->_lock);
+    w->_tasks.push_back(task);
+    pthread_mutex_unlock(&w->_lock);
+    __sync_fetch_and_add(&_queued, 1);
+    __sync_fetch_and_add(&_spawns, 1);
+    pthread_mutex_lock(&_idle_lock);
+    pthread_cond_broadcast(&_idle);
+    pthread_mutex_unlock(&_idle_lock);
+}
+
+bool Scheduler::run_task(int self, TaskGroup* group)
+{
+    Task task;
+    bool found = false;
+    Worker* own = _workers[self];
+    Worker* outside = _workers.back();
+    pthread_mutex_lock(&own->_lock);
+    if (!own->_tasks.empty() && (own != outside || group == NULL || own->_tasks.back()._group == group))
+    {
+        task = own->_tasks.back();
+        own->_tasks.pop_back();
+        found = true;
+    }
+    pthread_mutex_unlock(&own->_lock);
+
+    // steal the oldest task of the next worker that has one, the outside deque included
+    for (size_t k = 1; !found && k < _workers.size(); k++)
+    {
+        Worker* victim = _workers[(self + k) % _workers.size()];
+        pthread_mutex_lock(&victim->_lock);
+        if (!victim->_tasks.empty() && (victim != outside || group == NULL || victim->_tasks.front()._group == group))
+        {
+            task = victim->_tasks.front();
+            victim->_tasks.pop_front();
+            found = true;
+            __sync_fetch_and_add(&_steals, 1);
+        }
+        pthread_mutex_unlock(&victim->_lock);
+    }
+    if (!found)
+        return false;
+
+    __sync_fetch_and_sub(&_queued, 1);
+    task._fn(task._arg);
+    if (__sync_sub_and_fetch(&task._group->_pending, 1) == 0)
+    {
+        pthread_mutex_lock(&_idle_lock);
+        pthread_cond_broadcast(&_idle);
+        pthread_mutex_unlock(&_idle_lock);
+    }
+    return true;
+}
+
+void Scheduler::wait(TaskGroup& group)
+{
+    int self = current_scheduler == this ? current_worker : _threads.size();
+    while (group._pending > 0)
+    {
+        unsigned long spawns = _spawns;
+        if (run_task(self, &group))
+            continue;
+        // the tasks queued, if any, are not ours to run. sleep until the group finishes or more are spawned
+        pthread_mutex_lock(&_idle_lock);
+        while (group._pending > 0 && _spawns == spawns)
+            pthread_cond_wait(&_idle, &_idle_lock);
+        pthread_mutex_unlock(&_idle_lock);
+    }
+}
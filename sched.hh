@@ -0,0 +1,131 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Work-stealing task scheduler. Each worker thread has its own deque of tasks:
+ * it pushes the tasks it spawns and pops them back from the same end, and when
+ * it runs out it steals the oldest task of another worker. A thread that waits
+ * for a group of tasks runs tasks in the meantime, so tasks may spawn tasks and
+ * wait for them, e.g. a comparison job waiting for its frame scores. Of the
+ * tasks spawned from outside the workers, e.g. whole comparison jobs, a waiting
+ * thread runs only those of the group it waits for, so that one job does not
+ * end up waiting under another. Bounded queues connect the threads of pipelines.
+ */
+
+#ifndef _SCHED_HH_
+#define _SCHED_HH_
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+typedef void (*task_fn)(void* arg);
+
+// a set of tasks that can be waited for together
+struct TaskGroup
+{
+    TaskGroup() : _pending(0) { }
+    volatile long _pending; // tasks spawned and not finished yet
+};
+
+class Scheduler
+{
+public:
+    Scheduler(int threads); // starts this many worker threads
+    ~Scheduler(); // waits for the workers to run out of tasks, then stops them
+
+    void spawn(TaskGroup& group, task_fn fn, void* arg); // queues fn(arg) as a task of the group
+    void wait(TaskGroup& group); // returns when every task of the group is finished, running tasks meanwhile
+    int threads() const { return _threads.size(); }
+    unsigned long steals() const { return _steals; } // number of tasks taken from another worker so far
+
+private:
+    struct Task
+    {
+        task_fn _fn;
+        void* _arg;
+        TaskGroup* _group;
+    };
+
+    struct Worker
+    {
+        std::deque<Task> _tasks;
+        pthread_mutex_t _lock;
+    };
+
+    static void* worker_main(void* arg);
+    bool run_task(int self, TaskGroup* group); // runs one task, its own or a stolen one, returns false if there was none. tasks spawned from outside are taken only if of the group, unless it is NULL
+
+    std::vector<Worker*> _workers; // the last deque takes tasks spawned from outside the workers
+    std::vector<pthread_t> _threads;
+    pthread_mutex_t _idle_lock;
+    pthread_cond_t _idle; // signalled when tasks are spawned or a group finishes
+    volatile long _queued; // tasks in the deques
+    volatile unsigned long _spawns; // tasks spawned so far, so that a waiter that found none to run knows when to look again
+    volatile bool _stop;
+    volatile unsigned long _steals;
+};
+
+// a queue of at most a given number of items between the stages of a pipeline. producers wait while it is
+// full and consumers while it is empty, until it is closed.
+template<class T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(size_t capacity) : _capacity(capacity), _closed(false)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        pthread_cond_init(&_not_empty, NULL);
+        pthread_cond_init(&_not_full, NULL);
+    }
+    ~BoundedQueue()
+    {
+        pthread_cond_destroy(&_not_full);
+        pthread_cond_destroy(&_not_empty);
+        pthread_mutex_destroy(&_lock);
+    }
+
+    void push(const T& item)
+    {
+        pthread_mutex_lock(&_lock);
+        while (_items.size() >= _capacity)
+            pthread_cond_wait(&_not_full, &_lock);
+        _items.push_back(item);
+        pthread_cond_signal(&_not_empty);
+        pthread_mutex_unlock(&_lock);
+    }
+
+    // takes the oldest item, returns false once the queue is closed and empty
+    bool pop(T& item)
+    {
+        pthread_mutex_lock(&_lock);
+        while (_items.empty() && !_closed)
+            pthread_cond_wait(&_not_empty, &_lock);
+        bool found = !_items.empty();
+        if (found)
+        {
+            item = _items.front();
+            _items.pop_front();
+            pthread_cond_signal(&_not_full);
+        }
+        pthread_mutex_unlock(&_lock);
+        return found;
+    }
+
+    void close() // no more items will be pushed
+    {
+        pthread_mutex_lock(&_lock);
+        _closed = true;
+        pthread_cond_broadcast(&_not_empty);
+        pthread_mutex_unlock(&_lock);
+    }
+
+private:
+    std::deque<T> _items;
+    size_t _capacity;
+    bool _closed;
+    pthread_mutex_t _lock;
+    pthread_cond_t _not_empty, _not_full;
+};
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Segmented alignment.
+ *
+ * A pre-pass takes a small fingerprint of every frame and finds scene cuts in
+ * both videos. Cuts of the second video are looked up in an index of the cuts of
+ * the first, and those that match one cut clearly better than any other become
+ * anchors. An optimal path that goes through the anchors splits into independent
+ * paths between them, so the segments are aligned in parallel with the compiled
+ * search engine and their paths are joined. This is exact when every anchor lies
+ * on an optimal path. Each segment is aligned in a VQATS of its own, with runs of
+ * repeated frames marked as in the caller, and an anytime search shares what is
+ * left of its deadline among the segments still to be aligned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include "vqats.hh"
+
+// Macros from http://en.wikipedia.org/wiki/C_preprocessor to prevent side effects
+#define min(a,b) \
+       ({ typeof (a) _a = (a); \
+           typeof (b) _b = (b); \
+         _a < _b ? _a : _b; })
+
+#define max(a,b) \
+       ({ typeof (a) _a = (a); \
+           typeof (b) _b = (b); \
+         _a > _b ? _a : _b; })
+
+#define CUT_THRESHOLD 32 // mean absolute thumbnail difference, out of 255, that makes a scene cut
+#define HASH_BANDS 8 // the hash is indexed in this many bands, so cuts within HASH_BANDS - 1 bits are always found
+#define HASH_BITS 64 // bits in a fingerprint hash
+
+struct Anchor
+{
+    frame_t _i1, _i2; // the anchor splits the videos before these frames
+    double _confidence;
+};
+
+struct SegmentJob
+{
+    std::vector<std::string> _paths1, _paths2;
+    score_t _score;
+    SearchResult _result;
+    unsigned long _frame_scores, _memo_lookups, _memo_hits;
+    unsigned long _frame_bounds, _frame_prunes, _identical_scores;
+};
+
+struct SegmentQueue
+{
+    std::vector<SegmentJob>* _jobs;
+    const SearchOptions* _options;
+    size_t _next; // next job to take
+    size_t _threads; // workers taking jobs
+    double _deadline; // wall time at which an anytime search ends, 0 for none
+    pthread_mutex_t _lock;
+};
+
+static inline bool anchor_order(const Anchor& a, const Anchor& b)
+{
+    return a._i1 < b._i1 || (a._i1 == b._i1 && a._i2 < b._i2);
+}
+
+static inline int hamming(uint64_t a, uint64_t b)
+{
+    return __builtin_popcountll(a ^ b);
+}
+
+// frames of a video that start a new scene
+static std::vector<frame_t> find_cuts(VideoData& video)
+{
+    std::vector<frame_t> cuts;
+    for (frame_t i = 1; i < video._frames.size(); i++)
+    {
+        FrameData& a = video.frame(i - 1);
+        FrameData& b = video.frame(i);
+        if (!a.fingerprint() || !b.fingerprint())
+            continue;
+        int diff = 0;
+        for (int k = 0; k < FP_SIZE * FP_SIZE; k++)
+            diff += abs(a._thumb[k] - b._thumb[k]);
+        if (diff > CUT_THRESHOLD * FP_SIZE * FP_SIZE)
+            cuts.push_back(i);
+    }
+    return cuts;
+}
+
+// distance between the cut before frame i1 of the first video and the cut before frame i2 of the second,
+// over the frames on both sides of the cuts
+static inline int cut_distance(VideoData& video1, VideoData& video2, frame_t i1, frame_t i2)
+{
+    return hamming(video1.frame(i1 - 1)._hash, video2.frame(i2 - 1)._hash) +
+        hamming(video1.frame(i1)._hash, video2.frame(i2)._hash);
+}
+
+static std::vector<Anchor> find_anchors(VideoData& video1, VideoData& video2, double min_confidence)
+{
+    std::vector<frame_t> cuts1 = find_cuts(video1);
+    std::vector<frame_t> cuts2 = find_cuts(video2);
+
+    // index the cuts of the first video by each band of the hash of the frame after the cut
+    typedef std::multimap<uint32_t, frame_t> CutIndex;
+    CutIndex index;
+    const int band_bits = HASH_BITS / HASH_BANDS;
+    for (size_t k = 0; k < cuts1.size(); k++)
+    {
+        uint64_t hash = video1.frame(cuts1[k])._hash;
+        for (int b = 0; b < HASH_BANDS; b++)
+            index.insert(std::make_pair((b << band_bits) | ((hash >> (b * band_bits)) & ((1 << band_bits) - 1)), cuts1[k]));
+    }
+
+    // a cut is a good anchor when it is near one cut of the first video and far from the others. unrelated
+    // frames differ in about half their bits, which caps the distance to the runner up.
+    std::vector<Anchor> anchors;
+    for (size_t k = 0; k < cuts2.size(); k++)
+    {
+        uint64_t hash = video2.frame(cuts2[k])._hash;
+        std::set<frame_t> candidates;
+        for (int b = 0; b < HASH_BANDS; b++)
+        {
+            std::pair<CutIndex::iterator, CutIndex::iterator> range =
+                index.equal_range((b << band_bits) | ((hash >> (b * band_bits)) & ((1 << band_bits) - 1)));
+            for (CutIndex::iterator it = range.first; it != range.second; ++it)
+                candidates.insert(it->second);
+        }
+        int best = HASH_BITS, second = HASH_BITS;
+        frame_t best_i1 = 0;
+        for (std::set<frame_t>::iterator it = candidates.begin(); it != candidates.end(); ++it)
+        {
+            int d = cut_distance(video1, video2, *it, cuts2[k]);
+            if (d < best)
+            {
+                second = best;
+                best = d;
+                best_i1 = *it;
+            }
+            else if (d < second)
+                second = d;
+        }
+        if (best >= second)
+            continue;
+        Anchor a;
+        a._i1 = best_i1;
+        a._i2 = cuts2[k];
+        a._confidence = 1.0 - (double)best / second;
+        if (a._confidence >= min_confidence)
+            anchors.push_back(a);
+    }
+
+    // keep the chain of anchors, increasing in both videos, with the largest total confidence
+    std::sort(anchors.begin(), anchors.end(), anchor_order);
+    std::vector<double> total(anchors.size());
+    std::vector<int> prev(anchors.size(), -1);
+    int last = -1;
+    for (size_t k = 0; k < anchors.size(); k++)
+    {
+        total[k] = anchors[k]._confidence;
+        for (size_t j = 0; j < k; j++)
+        {
+            if (anchors[j]._i1 < anchors[k]._i1 && anchors[j]._i2 < anchors[k]._i2 &&
+                total[j] + anchors[k]._confidence > total[k])
+            {
+                total[k] = total[j] + anchors[k]._confidence;
+                prev[k] = j;
+            }
+        }
+        if (last < 0 || total[k] > total[last])
+            last = k;
+    }
+    std::vector<Anchor> chain;
+    for (int k = last; k >= 0; k = prev[k])
+        chain.push_back(anchors[k]);
+    std::reverse(chain.begin(), chain.end());
+    return chain;
+}
+
+static void* segment_worker(void* arg)
+{
+    SegmentQueue* queue = (SegmentQueue*)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&queue->_lock);
+        size_t k = queue->_next++;
+        pthread_mutex_unlock(&queue->_lock);
+        if (k >= queue->_jobs->size())
+            break;
+
+        // each segment gets its own cache of frames. its frame scores draw their windows from a random state
+        // of their own, not from rand, so they do not depend on the segments aligned alongside
+        SegmentJob& job = (*queue->_jobs)[k];
+        VQATS v;
+        video_t video1 = v.add_video(job._paths1);
+        video_t video2 = v.add_video(job._paths2);
+        SearchOptions options = *queue->_options;
+        options._compare = false; // comparisons are made on the whole videos
+        if (options._runs >= 0)
+        {
+            v.collapse_runs(video1, options._runs);
+            v.collapse_runs(video2, options._runs);
+        }
+        if (queue->_deadline > 0)
+        {
+            // the segments left are aligned a round of workers at a time, and each round gets an equal share of
+            // the time left. a share that has run out still gives an anytime search, which returns its first path
+            size_t left = queue->_jobs->size() - k;
+            size_t rounds = (left + queue->_threads - 1) / queue->_threads;
+            options._deadline = max((queue->_deadline - wall_time()) / rounds, 1e-6);
+        }
+        job._score = compute_video_score(v, video1, video2, options, &job._result);
+        job._frame_scores = v.frame_scores();
+        job._memo_lookups = v.memo_lookups();
+        job._memo_hits = v.memo_hits();
+        job._frame_bounds = v.frame_bounds();
+        job._frame_prunes = v.frame_prunes();
+        job._identical_scores = v.identical_scores();
+    }
+    return NULL;
+}
+
+score_t compute_segmented_score(VQATS& v, const video_t& video1, const video_t& video2,
+                                const SearchOptions& options, SearchResult* result)
+{
+    VideoData& data1 = v._video_map[video1];
+    VideoData& data2 = v._video_map[video2];
+    frame_t n1 = data1._frames.size();
+    frame_t n2 = data2._frames.size();
+
+    std::vector<Anchor> anchors = find_anchors(data1, data2, options._anchors);
+    for (size_t k = 0; k < anchors.size(); k++)
+        printf("Anchor = %d %d Confidence = %.4f\n", anchors[k]._i1, anchors[k]._i2, anchors[k]._confidence);
+
+    // segment k runs from anchor k - 1 to anchor k, with the starts and ends of the videos as the outer anchors
+    std::vector<SegmentJob> jobs(anchors.size() + 1);
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+        frame_t first1 = k > 0 ? anchors[k - 1]._i1 : 0, last1 = k < anchors.size() ? anchors[k]._i1 : n1;
+        frame_t first2 = k > 0 ? anchors[k - 1]._i2 : 0, last2 = k < anchors.size() ? anchors[k]._i2 : n2;
+        for (frame_t i = first1; i < last1; i++)
+            jobs[k]._paths1.push_back(data1.frame(i)._path);
+        for (frame_t i = first2; i < last2; i++)
+            jobs[k]._paths2.push_back(data2.frame(i)._path);
+    }
+
+    SegmentQueue queue;
+    queue._jobs = &jobs;
+    queue._options = &options;
+    queue._next = 0;
+    pthread_mutex_init(&queue._lock, NULL);
+    std::vector<pthread_t> threads(min((size_t)options._threads, jobs.size()));
+    queue._threads = threads.size();
+    queue._deadline = options._deadline > 0 ? wall_time() + options._deadline : 0;
+    for (size_t t = 0; t < threads.size(); t++)
+        pthread_create(&threads[t], NULL, segment_worker, &queue);
+    for (size_t t = 0; t < threads.size(); t++)
+        pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&queue._lock);
+
+    // join the paths of the segments
+    score_t sum = 0, lower = 0;
+    uint32_t length = 0;
+    unsigned long expansions = 0;
+    bool timed_out = false;
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+        sum += jobs[k]._result._sum;
+        lower += jobs[k]._result._lower;
+        length += jobs[k]._result._length;
+        expansions += jobs[k]._result._expansions;
+        timed_out = timed_out || jobs[k]._result._timed_out;
+        v.add_counters(jobs[k]._frame_scores, jobs[k]._memo_lookups, jobs[k]._memo_hits,
+                       jobs[k]._frame_bounds, jobs[k]._frame_prunes, jobs[k]._identical_scores);
+    }
+    printf("Segments = %lu\n", (unsigned long)jobs.size());
+
+#ifdef DEBUG
+    printf("Sum = %f\n", sum);
+    printf("Length = %d\n", length);
+#endif
+    fflush(stdout);
+
+    if (result)
+    {
+        // the bounds hold for paths through the anchors, which include an optimal path if the anchors are right
+        result->set(sum, lower, length, n1, n2);
+        result->_expansions = expansions;
+        result->_timed_out = timed_out;
+    }
+
+    return 1.0 - sum / length;
+}
+
@@ -0,0 +1,267 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * See header file for a description.
+ *
+ * A job is sent as one line of tab-separated fields: the working directory of
+ * the client, then its arguments. The workers are forked processes that all
+ * accept on the listening socket, so the kernel hands each job to an idle one.
+ * A job has the whole process to itself, including its standard output, and a
+ * worker that dies on a job is replaced. The output of a job is followed by a
+ * NUL byte and the exit status of the job in decimal; reports are text, so the
+ * NUL cannot be part of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "server.hh"
+
+#define MAX_JOB_SIZE 65536 // longest job line accepted
+#ifndef JOB_READ_TIMEOUT
+    #define JOB_READ_TIMEOUT 10 // seconds a worker waits for the job line of a client it has accepted
+#endif
+
+static bool socket_address(const char* socket_path, struct sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return false;
+    }
+    strcpy(addr.sun_path, socket_path);
+    return true;
+}
+
+// sends a job that is not run the reason why, as its output, and a failed exit status
+static void reject_job(int client, const char* reason)
+{
+    std::string reply = reason;
+    reply += '\n';
+    reply += '\0';
+    reply += "-1";
+    if (write(client, reply.data(), reply.size()) < 0)
+        return; // the client has gone away
+}
+
+// reads one job line from the client, returns false if there is none. a line longer than MAX_JOB_SIZE, or
+// one that does not arrive within JOB_READ_TIMEOUT, is rejected
+static bool read_job(int client, std::vector<std::string>& fields)
+{
+    std::string line;
+    char c;
+    while (true)
+    {
+        if (line.size() >= MAX_JOB_SIZE)
+        {
+            reject_job(client, "Job line longer than MAX_JOB_SIZE");
+            return false;
+        }
+        ssize_t n = read(client, &c, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            reject_job(client, "Job line not received in time");
+            return false;
+        }
+        if (n <= 0)
+            return false;
+        if (c == '\n')
+            break;
+        line += c;
+    }
+    fields.clear();
+    size_t start = 0;
+    while (true)
+    {
+        size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+        if (tab == std::string::npos)
+            break;
+        start = tab + 1;
+    }
+    return fields.size() >= 1;
+}
+
+static void worker(int listener, job_handler handler)
+{
+    signal(SIGPIPE, SIG_IGN); // a client that goes away only loses its output
+    while (true)
+    {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            _exit(1);
+        }
+        // a client that connects and sends nothing would otherwise hold the worker forever
+        struct timeval timeout;
+        timeout.tv_sec = JOB_READ_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::vector<std::string> fields;
+        if (!read_job(client, fields))
+        {
+            close(client);
+            continue;
+        }
+        if (chdir(fields[0].c_str()) != 0)
+        {
+            reject_job(client, "Unable to enter the working directory of the job");
+            close(client);
+            continue;
+        }
+
+        // the handler takes a command line as main does, with the fields after the directory as arguments
+        std::vector<char*> argv;
+        argv.push_back((char*)"vqats");
+        for (size_t k = 1; k < fields.size(); k++)
+            argv.push_back((char*)fields[k].c_str());
+        argv.push_back(NULL);
+
+        fflush(stdout);
+        int saved = dup(1);
+        dup2(client, 1);
+        int status = handler(argv.size() - 1, &argv[0]);
+        fflush(stdout);
+        putchar('\0');
+        printf("%d", status);
+        fflush(stdout);
+        dup2(saved, 1);
+        close(saved);
+        close(client);
+    }
+}
+
+int serve_jobs(const char* socket_path, int workers, job_handler handler)
+{
+    struct sockaddr_un addr;
+    if (!socket_address(socket_path, addr))
+        return -1;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0)
+    {
+        perror(socket_path);
+        return -1;
+    }
+    printf("Listening = %s\n", socket_path);
+    printf("Workers = %d\n", workers);
+    fflush(stdout);
+
+    // start the workers, and replace any that dies
+    for (int w = 0; w < workers; w++)
+        if (fork() == 0)
+            worker(listener, handler);
+    while (true)
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        fprintf(stderr, "Worker %d exited with status %d, restarting\n", (int)pid, status);
+        if (fork() == 0)
+            worker(listener, handler);
+    }
+    close(listener);
+    return 0;
+}
+
+int send_job(const char* socket_path, int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    if (!socket_address(socket_path, addr))
+        return -1;
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        perror("getcwd");
+        return -1;
+    }
+    std::string job = cwd;
+    for (int k = 0; k < argc; k++)
+    {
+        if (strpbrk(argv[k], "\t\n") != NULL)
+        {
+            fprintf(stderr, "Arguments with tabs or newlines cannot be sent: %s\n", argv[k]);
+            return -1;
+        }
+        job += '\t';
+        job += argv[k];
+    }
+    job += '\n';
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror(socket_path);
+        return -1;
+    }
+    for (size_t sent = 0; sent < job.size(); )
+    {
+        ssize_t n = write(server, job.data() + sent, job.size() - sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror(socket_path);
+            close(server);
+            return -1;
+        }
+        sent += n;
+    }
+    shutdown(server, SHUT_WR);
+
+    // the output up to the NUL, then the exit status. a worker that dies on the job sends no status
+    char buffer[4096];
+    bool ended = false;
+    std::string status;
+    while (true)
+    {
+        ssize_t n = read(server, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        char* end = ended ? buffer : (char*)memchr(buffer, '\0', n);
+        if (end == NULL)
+        {
+            fwrite(buffer, 1, n, stdout);
+            continue;
+        }
+        if (!ended)
+        {
+            fwrite(buffer, 1, end - buffer, stdout);
+            end++;
+            ended = true;
+        }
+        status.append(end, buffer + n - end);
+    }
+    fflush(stdout);
+    close(server);
+    if (!ended || status.empty())
+    {
+        fprintf(stderr, "Job ended without a status\n");
+        return -1;
+    }
+    return atoi(status.c_str());
+}
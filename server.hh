@@ -0,0 +1,25 @@
+/*
+ * Video Quality Assessment Tool using SSIM (VQATS).
+ * Written by Kah Keng Tay, kahkeng AT gmail DOT com, 2008.
+ *
+ * Comparison daemon. A server listens on a Unix domain socket and runs each job,
+ * a command line of the tool, in one of a pool of worker processes. Workers live
+ * across jobs, so whatever a job leaves loaded is there for the next one. The
+ * output of a job is sent back to its client.
+ */
+
+#ifndef _SERVER_HH_
+#define _SERVER_HH_
+
+typedef int (*job_handler)(int argc, char** argv);
+
+// runs jobs sent to the socket until the server is killed, calling the handler in the worker that takes
+// the job, in the working directory of the client and with its standard output going to the client,
+// followed by the value the handler returns. returns non-zero if the socket cannot be set up.
+int serve_jobs(const char* socket_path, int workers, job_handler handler);
+
+// sends a command line to the server as a job and copies its output to the standard output.
+// returns the exit status of the job, or non-zero if the server cannot be reached or the job ends without one.
+int send_job(const char* socket_path, int argc, char** argv);
+
+#endif
@@ -1,23 +1,476 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
 #include "vqats.hh"
+#include "server.hh"
+#include "sched.hh"
+
+#ifndef DAEMON_WORKERS
+    #define DAEMON_WORKERS 4 // worker processes of a daemon
+#endif
+#ifndef WARM_BUDGET
+    #define WARM_BUDGET 2000 // most frames kept loaded by a daemon worker between jobs
+#endif
 
 // takes as input two text files containing paths to images in a video sequence, and prints out the VQATS similarity score.
+// given more test videos, the first is taken as the reference for all of them and is loaded only once.
+// run as a daemon, each worker keeps the videos of its recent jobs warm for the next ones.
 
-int main(int argc, char** argv)
+static void usage(const char* name)
+{
+    printf("Syntax: %s [-e epsilon] [-c] [-t seconds] [-s] [-w band] [-l lag] [-a confidence] [-j threads] [-r tolerance] [-z] [-p] [-f] [-k frames] [-x threads] [-d socket [-n workers] [-b frames] | -q socket] <video-text-file1> <video-text-file2> [<video-text-file3> ...]\n", name);
+    printf("        %s [options] -m <job-list-file> [-n threads]\n\n", name);
+    printf("  -e epsilon  weighted search, the path found costs at most (1 + epsilon) times the optimal one\n");
+    printf("  -c          also run the exact search and report the weighted search against it\n");
+    printf("  -t seconds  anytime search, returns the best path found when the deadline expires\n");
+    printf("  -s          read the frame lists as they grow, e.g. from pipes\n");
+    printf("  -w band     streaming search, largest offset between matched frames\n");
+    printf("  -l lag      streaming search, frames held before a frame is aligned for good\n");
+    printf("  -a confidence  segmented search, splits the videos at scene cuts matched with this confidence\n");
+    printf("  -j threads  segmented search, segments aligned at once. vqatsL, threads per pipeline stage\n");
+    printf("  -r tolerance  collapse runs of repeated frames, 0 for bit-identical frames only\n");
+    printf("  -z          lazy search, scores frames only when their move is the best candidate\n");
+    printf("  -p          proxy search, aligns on thumbnails and scores the matched frames only\n");
+    printf("  -f          fast path, searches near the diagonal only when that is proven to be enough\n");
+    printf("  -k frames   frames of the first video kept loaded, for comparing it with several videos\n");
+    printf("  -x threads  full SSIM, threads computing the row bands of each frame score. job list, any to use its threads\n");
+    printf("  -d socket   run as a daemon, taking jobs on this socket\n");
+    printf("  -n workers  daemon, worker processes. job list, threads (default all cores)\n");
+    printf("  -b frames   daemon, most frames each worker keeps loaded between jobs\n");
+    printf("  -q socket   send the job to the daemon on this socket instead of running it\n");
+    printf("  -m list     run the comparisons of a file of reference and test frame list pairs, one per line\n\n");
+}
+
+// compares two loaded videos and prints the report, returning the score
+static score_t compare(VQATS& v, const video_t& v1, const video_t& v2, const SearchOptions& options, SearchResult& result)
+{
+    unsigned long frame_scores = v.frame_scores(), memo_lookups = v.memo_lookups(), memo_hits = v.memo_hits();
+    unsigned long frame_bounds = v.frame_bounds(), frame_prunes = v.frame_prunes();
+    unsigned long identical_scores = v.identical_scores();
+    score_t s;
+    if (!options._fast || options._stream || !compute_fast_score(v, v1, v2, options, s, &result))
+        s = options._anchors > 0 ? compute_segmented_score(v, v1, v2, options, &result)
+                                 : compute_video_score(v, v1, v2, options, &result);
+    frame_scores = v.frame_scores() - frame_scores;
+    memo_lookups = v.memo_lookups() - memo_lookups;
+    memo_hits = v.memo_hits() - memo_hits;
+    printf("Expansions = %lu\n", result._expansions);
+    printf("FrameScores = %lu\n", frame_scores);
+    if (memo_lookups > 0)
+        printf("MemoHits = %lu of %lu (%.1f%%)\n", memo_hits, memo_lookups, 100.0 * memo_hits / memo_lookups);
+    frame_bounds = v.frame_bounds() - frame_bounds;
+    frame_prunes = v.frame_prunes() - frame_prunes;
+    if (frame_bounds > 0)
+        printf("FrameBounds = %lu\n", frame_bounds);
+    if (frame_prunes > 0)
+        printf("FramePrunes = %lu\n", frame_prunes);
+    identical_scores = v.identical_scores() - identical_scores;
+    if (identical_scores > 0)
+        printf("IdenticalScores = %lu\n", identical_scores);
+    printf("Bound = %.4f %.4f\n", result._score_lower, result._score_upper);
+    if (result._timed_out)
+        printf("TimedOut = 1\n");
+
+    if (options._compare && options._epsilon > 0)
+    {
+        SearchOptions exact = options;
+        exact._epsilon = 0;
+        exact._deadline = 0;
+        SearchResult exact_result;
+        // the exact search finds the scores of the weighted search in the memo, so the searches are
+        // compared on the frame scores they ask for
+        unsigned long exact_lookups = v.memo_lookups();
+        score_t exact_s = compute_video_score(v, v1, v2, exact, &exact_result);
+        exact_lookups = v.memo_lookups() - exact_lookups;
+        printf("ExactScore = %.4f\n", exact_s);
+        printf("ExactExpansions = %lu (%.1f%%)\n", exact_result._expansions,
+               exact_result._expansions ? 100.0 * result._expansions / exact_result._expansions : 0.0);
+        printf("ExactFrameScores = %lu (%.1f%%)\n", exact_lookups,
+               exact_lookups ? 100.0 * memo_lookups / exact_lookups : 0.0);
+        printf("CostRatio = %.4f\n", exact_result._sum > 0 ? result._sum / exact_result._sum : 1.0);
+    }
+
+    if (options._compare && options._anchors > 0)
+    {
+        unsigned long global_frame_scores = v.frame_scores();
+        score_t global_s = compute_video_score(v, v1, v2, options);
+        global_frame_scores = v.frame_scores() - global_frame_scores;
+        printf("GlobalScore = %.4f\n", global_s);
+        printf("GlobalFrameScores = %lu\n", global_frame_scores);
+    }
+
+    printf("Score: %.4f\n", s);
+    fflush(stdout);
+    return s;
+}
+
+struct ToolOptions
+{
+    SearchOptions _search;
+    frame_t _cache_size; // frames of the reference kept loaded, 0 for CACHE_SIZE
+    const char* _serve; // socket to take jobs on
+    const char* _send; // socket to send the job to
+    const char* _batch; // list of comparisons to run
+    int _workers; // 0 for the default
+    frame_t _budget;
+    int _bands; // threads computing the row bands of frame scores, 0 for none
+
+    ToolOptions() : _cache_size(0), _serve(NULL), _send(NULL), _batch(NULL), _workers(0), _budget(WARM_BUDGET), _bands(0) {}
+};
+
+// returns false on a bad command line
+static bool parse_options(int argc, char** argv, ToolOptions& tool)
+{
+    SearchOptions& options = tool._search;
+    optind = 0; // jobs of a daemon parse a command line each
+    int c;
+    while ((c = getopt(argc, argv, "e:ct:sw:l:a:j:r:zpfk:x:d:n:b:q:m:")) != -1)
+    {
+        switch (c)
+        {
+        case 'e': options._epsilon = atof(optarg); break;
+        case 'c': options._compare = true; break;
+        case 't': options._deadline = atof(optarg); break;
+        case 's': options._stream = true; break;
+        case 'w': options._band = atoi(optarg); break;
+        case 'l': options._lag = atoi(optarg); break;
+        case 'a': options._anchors = atof(optarg); break;
+        case 'j': options._threads = atoi(optarg); break;
+        case 'r': options._runs = atof(optarg); break;
+        case 'z': options._lazy = true; break;
+        case 'p': options._proxy = true; break;
+        case 'f': options._fast = true; break;
+        case 'k': tool._cache_size = atoi(optarg); break;
+        case 'x': tool._bands = atoi(optarg); break;
+        case 'd': tool._serve = optarg; break;
+        case 'n': tool._workers = atoi(optarg); break;
+        case 'b': tool._budget = atoi(optarg); break;
+        case 'q': tool._send = optarg; break;
+        case 'm': tool._batch = optarg; break;
+        default: return false;
+        }
+    }
+    if (tool._workers < 0 || tool._bands < 0)
+        return false;
+#ifdef SAMPLING_SIZE
+    if (tool._bands > 0)
+    {
+        printf("Option -x splits full SSIM frame scores, and this build samples windows instead\n");
+        return false;
+    }
+#endif
+    if (tool._serve)
+        return argc == optind && !tool._send && !tool._batch;
+    if (tool._batch)
+        return argc == optind && !tool._send && !options._stream && options._epsilon >= 0 &&
+            !options._compare && !options._fast && options._anchors <= 0; // their reports would interleave
+    return argc - optind >= 2 && options._epsilon >= 0 && options._band >= 0 && options._lag >= 1 && options._threads >= 1 &&
+        !(options._stream && argc - optind > 2) && // a streamed reference is released as it is read
+        !(options._stream && options._runs >= 0); // runs are found over whole frame lists
+}
+
+// a video loaded by an earlier job, kept until its frame list changes
+struct WarmVideo
+{
+    video_t _video;
+    time_t _mtime; // of the frame list when loaded
+    frame_t _repeats; // frames collapsed into runs
+    unsigned long _used; // job that last used it
+};
+
+typedef std::map<std::string, WarmVideo> WarmMap; // keyed on the real path of the frame list and the run tolerance
+
+// the videos and frame scores of earlier jobs stay here, so that a daemon worker starts its next job warm
+static VQATS warm;
+static WarmMap warm_videos;
+static unsigned long jobs = 0;
+static bool serving = false; // whether jobs run in a daemon worker, which keeps videos for the next ones
+
+// loads a video for the job, or finds it loaded by an earlier one. outside of a daemon, frame lists that cannot
+// be stat'ed, and streamed videos, are loaded for this job only and added to cold.
+static video_t acquire_video(const char* path, const SearchOptions& options, frame_t& repeats, std::vector<video_t>& cold)
+{
+    char real[PATH_MAX];
+    struct stat st;
+    if (!serving || options._stream || realpath(path, real) == NULL || stat(real, &st) != 0)
+    {
+        video_t video = options._stream ? warm.open_video(path) : warm.load_video(path);
+        if (video == 0) return 0;
+        cold.push_back(video);
+        repeats = options._runs >= 0 ? warm.collapse_runs(video, options._runs) : 0;
+        return video;
+    }
+
+    char tolerance[32];
+    sprintf(tolerance, "\t%g", options._runs);
+    std::string key = std::string(real) + tolerance;
+    WarmMap::iterator it = warm_videos.find(key);
+    if (it != warm_videos.end() && it->second._mtime != st.st_mtime)
+    {
+        warm.remove_video(it->second._video);
+        warm_videos.erase(it);
+        it = warm_videos.end();
+    }
+    if (it == warm_videos.end())
+    {
+        WarmVideo w;
+        w._video = warm.load_video(path);
+        if (w._video == 0) return 0;
+        w._mtime = st.st_mtime;
+        w._repeats = options._runs >= 0 ? warm.collapse_runs(w._video, options._runs) : 0;
+        it = warm_videos.insert(std::make_pair(key, w)).first;
+    }
+    else if (it->second._used == jobs)
+    {
+        // a video compared with itself is loaded twice, as in a single run
+        video_t video = warm.load_video(path);
+        if (video == 0) return 0;
+        cold.push_back(video);
+        repeats = options._runs >= 0 ? warm.collapse_runs(video, options._runs) : 0;
+        return video;
+    }
+    it->second._used = jobs;
+    repeats = it->second._repeats;
+    return it->second._video;
+}
+
+// unloads the least recently used warm videos until at most budget frames stay loaded, counting the frame scores
+// memoised against a reference as the frames they take the memory of
+static void trim_warm_videos(frame_t budget)
+{
+    while (true)
+    {
+        frame_t loaded = 0;
+        WarmMap::iterator oldest = warm_videos.end();
+        for (WarmMap::iterator it = warm_videos.begin(); it != warm_videos.end(); ++it)
+        {
+            frame_t frames = warm.loaded_frames(it->second._video) + warm.memo_frames(it->second._video);
+            if (frames == 0) continue;
+            loaded += frames;
+            if (oldest == warm_videos.end() || it->second._used < oldest->second._used)
+                oldest = it;
+        }
+        if (loaded <= budget) break;
+        warm.unload_video(oldest->second._video);
+    }
+}
+
+// runs the comparison of a command line, in this process or in a daemon worker
+static int run_job(int argc, char** argv)
 {
-    if (argc < 3)
+    ToolOptions tool;
+    if (!parse_options(argc, argv, tool) || tool._serve || tool._batch)
     {
-        printf("Syntax: %s <video-text-file1> <video-text-file2>\n\n", argv[0]);
+        usage(argv[0]);
         return -1;
     }
+    const SearchOptions& options = tool._search;
+    VQATS& v = warm;
+    jobs++;
+
+    // the first video is the reference for every other one. its frames, fingerprints and runs are found
+    // once, and those in its cache are reused by the next comparison.
+    std::vector<video_t> cold;
+    frame_t r1;
+    video_t v1 = acquire_video(argv[optind], options, r1, cold);
+    if (v1 == 0) return -1;
+    v.set_cache_size(v1, tool._cache_size > 0 ? tool._cache_size : CACHE_SIZE);
+    Scheduler bands(std::max(tool._bands - 1, 0)); // the calling thread computes bands while it waits
+    v.set_row_bands(tool._bands > 0 ? &bands : NULL);
+    int tests = argc - optind - 1, failed = 0;
+    std::vector<score_t> scores(tests);
+    std::vector<SearchResult> results(tests);
+    std::vector<bool> loaded(tests);
+    for (int k = 0; k < tests; k++)
+    {
+        const char* path = argv[optind + 1 + k];
+        if (tests > 1)
+            printf("Test = %s\n", path);
+        frame_t r2;
+        video_t v2 = acquire_video(path, options, r2, cold);
+        loaded[k] = v2 != 0;
+        if (!loaded[k])
+        {
+            failed++;
+            continue;
+        }
+        if (options._runs >= 0)
+            printf("Collapsed = %u %u\n", r1, r2);
+        scores[k] = compare(v, v1, v2, options, results[k]);
+        if (!cold.empty() && cold.back() == v2)
+        {
+            // a test kept for no later job goes at once, so that many tests take the memory of one
+            v.remove_video(v2);
+            cold.pop_back();
+        }
+    }
+
+    // one line per test: score, bounds on the score, path
+    if (tests > 1)
+    {
+        for (int k = 0; k < tests; k++)
+            if (loaded[k])
+                printf("Result = %.4f %.4f %.4f %s\n", scores[k], results[k]._score_lower, results[k]._score_upper, argv[optind + 1 + k]);
+            else
+                printf("Result = failed %s\n", argv[optind + 1 + k]);
+    }
+
+    v.set_row_bands(NULL);
+    for (size_t k = 0; k < cold.size(); k++)
+        v.remove_video(cold[k]);
+    trim_warm_videos(tool._budget);
+    return failed > 0 ? -1 : 0;
+}
+
+// one comparison of a job list
+struct BatchJob
+{
+    std::string _path1, _path2;
+    const SearchOptions* _options;
+    bool _bands; // whether frame scores are split into row bands on the scheduler of the list
+    pthread_mutex_t* _print_lock;
+    score_t _score;
+    SearchResult _result;
+    unsigned long _frame_scores;
+    double _start, _end;
+    bool _ok;
+};
 
+static void batch_job(void* arg)
+{
+    BatchJob* job = (BatchJob*)arg;
+    job->_start = wall_time();
     VQATS v;
-    video_t v1 = v.load_video(argv[1]);
-    video_t v2 = v.load_video(argv[2]);
-    if (v1 == 0 || v2 == 0) return -1;
-    score_t s = compute_video_score(v, v1, v2);
-    printf("Score: %.4f\n", s);
-    
-    return 0;
+    if (job->_bands)
+        v.set_row_bands(job->_options->_scheduler);
+    video_t v1 = v.load_video(job->_path1);
+    video_t v2 = v1 != 0 ? v.load_video(job->_path2) : 0;
+    job->_ok = v2 != 0;
+    if (job->_ok)
+    {
+        if (job->_options->_runs >= 0)
+        {
+            v.collapse_runs(v1, job->_options->_runs);
+            v.collapse_runs(v2, job->_options->_runs);
+        }
+        job->_score = compute_video_score(v, v1, v2, *job->_options, &job->_result);
+        job->_frame_scores = v.frame_scores();
+    }
+    job->_end = wall_time();
+    pthread_mutex_lock(job->_print_lock);
+    if (job->_ok)
+        printf("Job = %.4f %.3f %s %s\n", job->_score, job->_end - job->_start, job->_path1.c_str(), job->_path2.c_str());
+    else
+        printf("Job = failed %s %s\n", job->_path1.c_str(), job->_path2.c_str());
+    fflush(stdout);
+    pthread_mutex_unlock(job->_print_lock);
 }
 
+// nearest-rank percentile of sorted values
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    size_t rank = (size_t)ceil(p * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// runs the comparisons of a job list as tasks of a work-stealing scheduler. vqatsD asks for its frame scores in
+// parallel tasks too, so a comparison left alone at the end still uses every thread; the other engines score a
+// comparison on the thread that runs it, and vqatsL starts the threads of its pipeline besides.
+static int run_batch(const char* list, int threads, const SearchOptions& search, bool bands)
+{
+    std::ifstream fs(list);
+    if (fs.fail())
+    {
+        printf("Unable to load job list %s\n", list);
+        return -1;
+    }
+    std::vector<BatchJob> jobs;
+    std::string path1, path2;
+    while (fs >> path1 >> path2)
+    {
+        jobs.resize(jobs.size() + 1);
+        jobs.back()._path1 = path1;
+        jobs.back()._path2 = path2;
+    }
+
+    // the calling thread runs tasks while it waits, so it counts as one of the threads
+    Scheduler scheduler(threads - 1);
+    SearchOptions options = search;
+    options._scheduler = &scheduler;
+    // a job reports its score only, as the reports of jobs running at once would interleave
+    options._quiet = true;
+    pthread_mutex_t print_lock;
+    pthread_mutex_init(&print_lock, NULL);
+    double start = wall_time();
+    TaskGroup group;
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+        jobs[k]._options = &options;
+        jobs[k]._bands = bands;
+        jobs[k]._print_lock = &print_lock;
+        scheduler.spawn(group, batch_job, &jobs[k]);
+    }
+    scheduler.wait(group);
+    double seconds = wall_time() - start;
+    pthread_mutex_destroy(&print_lock);
+
+    std::vector<double> latencies;
+    unsigned long frame_scores = 0;
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+        if (!jobs[k]._ok)
+            continue;
+        latencies.push_back(jobs[k]._end - jobs[k]._start);
+        frame_scores += jobs[k]._frame_scores;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("Jobs = %lu\n", (unsigned long)jobs.size());
+    if (latencies.size() < jobs.size())
+        printf("Failed = %lu\n", (unsigned long)(jobs.size() - latencies.size()));
+    printf("Threads = %d\n", threads);
+    printf("Steals = %lu\n", scheduler.steals());
+    printf("FrameScores = %lu\n", frame_scores);
+    printf("Seconds = %.3f\n", seconds);
+    printf("Throughput = %.2f jobs/s\n", seconds > 0 ? jobs.size() / seconds : 0.0);
+    if (!latencies.empty())
+        printf("Latency = %.3f %.3f %.3f %.3f\n", percentile(latencies, 0.5), percentile(latencies, 0.9),
+               percentile(latencies, 0.99), latencies.back());
+    return latencies.size() == jobs.size() ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+    ToolOptions tool;
+    if (!parse_options(argc, argv, tool))
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    serving = tool._serve != NULL;
+    if (tool._serve)
+        return serve_jobs(tool._serve, tool._workers > 0 ? tool._workers : DAEMON_WORKERS, run_job);
+    if (tool._batch)
+        return run_batch(tool._batch, tool._workers > 0 ? tool._workers : sysconf(_SC_NPROCESSORS_ONLN), tool._search, tool._bands > 0);
+    if (tool._send)
+    {
+        // the job is sent without the -q option, which comes before the frame lists
+        std::vector<char*> args;
+        for (int k = 1; k < argc; k++)
+        {
+            if (strcmp(argv[k], "-q") == 0) { k++; continue; }
+            if (strncmp(argv[k], "-q", 2) == 0) continue;
+            args.push_back(argv[k]);
+        }
+        return send_job(tool._send, args.size(), &args[0]);
+    }
+    return run_job(argc, argv);
+}
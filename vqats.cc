@@ -6,14 +6,24 @@
  */
 
 #include <string>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "vqats.hh"
+#include "sched.hh"
+#include "pool.hh"
 
 #ifdef SAMPLING_SIZE
-#include <stdlib.h>
 #include "cvmat.hh" // for modified CvScalar operators
 #endif
 
@@ -27,11 +37,81 @@
            typeof (b) _b = (b); \
          _a > _b ? _a : _b; })
 
+// the buffers of frame images and of the images of full SSIM computations, which all have the geometry of the
+// frames of a video, so that a frame loaded in place of an evicted one takes its buffers. never destroyed, as
+// frames of static VQATS objects may be unloaded after it would be.
+static BufferPool& frame_buffers()
+{
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+void
+FrameBuffer::create(int width, int height, int channels)
+{
+    if (_data != NULL && width == _width && height == _height && channels == _channels && *_refs == 1)
+        return;
+    release();
+    _width = width;
+    _height = height;
+    _channels = channels;
+    size_t align = FRAME_ALIGN / sizeof(float);
+    _stride = (width + align - 1) / align * align;
+    _plane = _stride * height;
+    char* memory = (char*)frame_buffers().alloc(FRAME_ALIGN + _plane * channels * sizeof(float)); // page aligned
+    _refs = (volatile int*)memory;
+    *_refs = 1;
+    _data = (float*)(memory + FRAME_ALIGN);
+}
+
+void
+FrameBuffer::share(const FrameBuffer& other)
+{
+    if (other._data == _data)
+        return;
+    release();
+    __sync_fetch_and_add(other._refs, 1);
+    _width = other._width;
+    _height = other._height;
+    _channels = other._channels;
+    _stride = other._stride;
+    _plane = other._plane;
+    _data = other._data;
+    _refs = other._refs;
+}
+
+void
+FrameBuffer::release()
+{
+    if (_data != NULL && __sync_sub_and_fetch(_refs, 1) == 0)
+        frame_buffers().free((void*)_refs, FRAME_ALIGN + _plane * _channels * sizeof(float));
+    _data = NULL;
+    _refs = NULL;
+}
+
+bool
+FrameBuffer::equals(const FrameBuffer& other) const
+{
+    if (_width != other._width || _height != other._height || _channels != other._channels)
+        return false;
+    for (int c = 0; c < _channels; c++)
+        for (int y = 0; y < _height; y++)
+            if (memcmp(row(c, y), other.row(c, y), _width * sizeof(float)) != 0)
+                return false;
+    return true;
+}
+
+CvMat*
+FrameBuffer::rows(int channel, int y0, int y1, CvMat* header) const
+{
+    return cvInitMatHeader(header, y1 - y0, _width, CV_32FC1, row(channel, y0), _stride * sizeof(float));
+}
+
 FrameData::FrameData()
-    : _loaded(false), _index(0), _image(NULL)
+    : _loaded(false), _loading(false), _pins(0), _index(0), _run(0), _repeated(false), _decoded(NULL), _listed(false), _fingerprinted(false), _hash(0), _content(0), _image_content(0)
 {
-#ifndef SAMPLING_SIZE
-    _image_sq = _mu = _mu_sq = _sigma_sq = NULL;
+#ifdef SAMPLING_SIZE
+    _summed = false;
 #endif
 }
 
@@ -53,72 +133,461 @@ FrameData::load()
 #ifdef DEBUG
         std::cout << "Loading frame " << _path << std::endl;
 #endif
-
-        _loaded = true;
-        _image = cvLoadImage(_path.c_str());
-        if (_image == NULL)
+        if (!decode())
             return false;
+        preprocess();
+    }
+    return true;
+}
+
+// hash of the pixels and geometry of an image, 8 bytes at a time with the mix of MurmurHash64A
+static uint64_t content_hash(const IplImage* image)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t h = ((uint64_t)image->width << 32 | image->height) * m ^ image->nChannels;
+    size_t bytes = image->width * image->nChannels;
+    for (int y = 0; y < image->height; y++)
+    {
+        const unsigned char* row = (const unsigned char*)(image->imageData + y * image->widthStep);
+        size_t x = 0;
+        for (; x + 8 <= bytes; x += 8)
+        {
+            uint64_t k;
+            memcpy(&k, row + x, 8);
+            k *= m;
+            k ^= k >> 47;
+            k *= m;
+            h = (h ^ k) * m;
+        }
+        for (; x < bytes; x++)
+            h = (h ^ row[x]) * m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    return h ^ (h >> 47);
+}
 
-        // precompute values that deal with only a single image
-        // convert the image to YCrCb color space, keeping the same depth as before (most likely IPL_DEPTH_8U)
-        _nChannels = _image->nChannels;
-        _size = cvSize(_image->width, _image->height);
-        IplImage* temp = cvCreateImage(_size, _image->depth, _nChannels);
-        cvCvtColor(_image, temp, CV_BGR2YCrCb);
-        cvReleaseImage(&_image);
+bool
+FrameData::decode()
+{
+    _loaded = true;
+    _decoded = cvLoadImage(_path.c_str());
+    if (_decoded == NULL)
+        return false;
+    _image_content = content_hash(_decoded); // apart from _content, which other threads may fingerprint at the same time
+    return true;
+}
 
-        // now convert it to IPL_DEPTH_32F to overcome the 0..255 range.
-        _depth = IPL_DEPTH_32F;
-        _image = cvCreateImage(_size, _depth, _nChannels);
-        cvConvert(temp, _image);
-        cvReleaseImage(&temp);
+// the frames holding buffers that a frame of the same content may share, by content hash. a frame is listed from
+// the end of its preprocessing until it is unloaded or recycled, so its buffers are whole while they can be shared.
+// every frame listed under a hash holds the same buffers, so any of them can be shared while one is left.
+typedef std::map<uint64_t, std::vector<FrameData*> > ContentMap;
+static pthread_mutex_t content_lock = PTHREAD_MUTEX_INITIALIZER;
 
-#ifndef SAMPLING_SIZE
-        _image_sq = cvCreateImage(_size, _depth, _nChannels);
-        cvPow(_image, _image_sq, 2);
+static ContentMap& content_frames()
+{
+    static ContentMap* frames = new ContentMap(); // never destroyed, as frames of static objects may be unloaded after it would be
+    return *frames;
+}
+
+// lists the frame as a holder of the buffers of its content, unless the frames listed under its hash hold others
+static void list_frame(FrameData& frame)
+{
+    pthread_mutex_lock(&content_lock);
+    std::vector<FrameData*>& holders = content_frames()[frame._image_content];
+    frame._listed = holders.empty() || holders.front()->_image.row(0, 0) == frame._image.row(0, 0);
+    if (frame._listed)
+        holders.push_back(&frame);
+    pthread_mutex_unlock(&content_lock);
+}
+
+static void unlist_frame(FrameData& frame)
+{
+    if (!frame._listed)
+        return;
+    pthread_mutex_lock(&content_lock);
+    ContentMap::iterator it = content_frames().find(frame._image_content);
+    std::vector<FrameData*>& holders = it->second;
+    holders.erase(std::find(holders.begin(), holders.end(), &frame));
+    if (holders.empty())
+        content_frames().erase(it);
+    frame._listed = false;
+    pthread_mutex_unlock(&content_lock);
+}
+
+// fixed point coefficients of opencv's 8-bit BGR to YCrCb conversion, meant to give the values of its own. make bench
+// checks them against the installed opencv
+#define YCC_SHIFT 14
+#define YCC_B 1868 // 0.114 * (1 << YCC_SHIFT), rounded
+#define YCC_G 9617 // 0.587
+#define YCC_R 4899 // 0.299
+#define YCC_CR 11682 // 0.713
+#define YCC_CB 9241 // 0.564
+#define YCC_DELTA ((128 << YCC_SHIFT) + (1 << (YCC_SHIFT - 1))) // chroma offset, plus rounding
 
-        _mu = cvCreateImage(_size, _depth, _nChannels);
-        _mu_sq = cvCreateImage(_size, _depth, _nChannels);
-        _sigma_sq = cvCreateImage(_size, _depth, _nChannels);
+static inline void convert_pixel(const unsigned char* p, float* qy, float* qcr, float* qcb)
+{
+    int y = (p[0] * YCC_B + p[1] * YCC_G + p[2] * YCC_R + (1 << (YCC_SHIFT - 1))) >> YCC_SHIFT;
+    int cr = ((p[2] - y) * YCC_CR + YCC_DELTA) >> YCC_SHIFT;
+    int cb = ((p[0] - y) * YCC_CB + YCC_DELTA) >> YCC_SHIFT;
+    *qy = y;
+    *qcr = min(max(cr, 0), 255);
+    *qcb = min(max(cb, 0), 255);
+}
 
-        cvSmooth(_image, _mu, CV_GAUSSIAN, 11, 11, 1.5);
-        cvPow(_mu, _mu_sq, 2);
-        cvSmooth(_image_sq, _sigma_sq, CV_GAUSSIAN, 11, 11, 1.5);
-        cvAddWeighted(_sigma_sq, 1, _mu_sq, -1, 0, _sigma_sq);
+void
+convert_ycrcb(const IplImage* bgr, FrameBuffer& ycrcb)
+{
+    // one pass from the decoded bytes to the floats the frame is scored on, where converting to YCrCb then to
+    // IPL_DEPTH_32F with opencv takes an 8-bit image in between and two passes
+    for (int y = 0; y < bgr->height; y++)
+    {
+        const unsigned char* p = (const unsigned char*)(bgr->imageData + y * bgr->widthStep);
+        float *qy = ycrcb.row(0, y), *qcr = ycrcb.row(1, y), *qcb = ycrcb.row(2, y);
+        int x = 0;
+#ifdef __SSE2__
+        // four pixels at a time. the 16-bit halves of each lane hold two channels, or a channel and 1, so that one
+        // multiply-add gives the sum of both products with their coefficients
+        const __m128i bg = _mm_set1_epi32(YCC_B | (YCC_G << 16));
+        const __m128i r1 = _mm_set1_epi32(YCC_R | ((1 << (YCC_SHIFT - 1)) << 16));
+        const __m128i cr = _mm_set1_epi32(YCC_CR), cb = _mm_set1_epi32(YCC_CB);
+        const __m128i delta = _mm_set1_epi32(YCC_DELTA), low = _mm_set1_epi32(0xffff);
+        const __m128 zero = _mm_setzero_ps(), full = _mm_set1_ps(255.0f);
+        for (; x + 4 <= bgr->width; x += 4, p += 12)
+        {
+            __m128i pb = _mm_setr_epi32(p[0] | (p[1] << 16), p[3] | (p[4] << 16), p[6] | (p[7] << 16), p[9] | (p[10] << 16));
+            __m128i pr = _mm_setr_epi32(p[2] | (1 << 16), p[5] | (1 << 16), p[8] | (1 << 16), p[11] | (1 << 16));
+            __m128i vy = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(pb, bg), _mm_madd_epi16(pr, r1)), YCC_SHIFT);
+            __m128i dr = _mm_and_si128(_mm_sub_epi32(_mm_and_si128(pr, low), vy), low);
+            __m128i db = _mm_and_si128(_mm_sub_epi32(_mm_and_si128(pb, low), vy), low);
+            __m128i vcr = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(dr, cr), delta), YCC_SHIFT);
+            __m128i vcb = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(db, cb), delta), YCC_SHIFT);
+            _mm_store_ps(qy + x, _mm_cvtepi32_ps(vy)); // rows are aligned, and x is a multiple of 4
+            _mm_store_ps(qcr + x, _mm_min_ps(_mm_max_ps(_mm_cvtepi32_ps(vcr), zero), full));
+            _mm_store_ps(qcb + x, _mm_min_ps(_mm_max_ps(_mm_cvtepi32_ps(vcb), zero), full));
+        }
 #endif
+        for (; x < bgr->width; x++, p += 3)
+            convert_pixel(p, qy + x, qcr + x, qcb + x);
     }
-    return true;
+}
+
+void
+FrameData::preprocess()
+{
+    // precompute values that deal with only a single image
+    // convert the image to YCrCb color space in IPL_DEPTH_32F to overcome the 0..255 range
+    int width = _decoded->width, height = _decoded->height, channels = _decoded->nChannels;
+
+    _image.create(width, height, channels);
+    convert_ycrcb(_decoded, _image);
+    cvReleaseImage(&_decoded);
+
+    // a frame of the same content, in this video or another, may have done the rest already. its buffers are
+    // held while they are compared with ours outside the lock, as different images may hash the same
+    FrameBuffer image;
+#ifndef SAMPLING_SIZE
+    FrameBuffer image_sq, mu, mu_sq, sigma_sq;
+#endif
+    pthread_mutex_lock(&content_lock);
+    ContentMap::iterator it = content_frames().find(_image_content);
+    if (it != content_frames().end())
+    {
+        FrameData& other = *it->second.front();
+        image.share(other._image);
+#ifndef SAMPLING_SIZE
+        image_sq.share(other._image_sq);
+        mu.share(other._mu);
+        mu_sq.share(other._mu_sq);
+        sigma_sq.share(other._sigma_sq);
+#endif
+    }
+    pthread_mutex_unlock(&content_lock);
+    if (!image.empty() && _image.equals(image))
+    {
+        _image.share(image);
+#ifndef SAMPLING_SIZE
+        _image_sq.share(image_sq);
+        _mu.share(mu);
+        _mu_sq.share(mu_sq);
+        _sigma_sq.share(sigma_sq);
+#endif
+        list_frame(*this);
+        return;
+    }
+
+#ifndef SAMPLING_SIZE
+    _image_sq.create(width, height, channels);
+    _mu.create(width, height, channels);
+    _mu_sq.create(width, height, channels);
+    _sigma_sq.create(width, height, channels);
+    for (int c = 0; c < channels; c++)
+    {
+        CvMat image, image_sq, mu, mu_sq, sigma_sq;
+        _image.rows(c, 0, height, &image);
+        _image_sq.rows(c, 0, height, &image_sq);
+        _mu.rows(c, 0, height, &mu);
+        _mu_sq.rows(c, 0, height, &mu_sq);
+        _sigma_sq.rows(c, 0, height, &sigma_sq);
+
+        cvPow(&image, &image_sq, 2);
+        cvSmooth(&image, &mu, CV_GAUSSIAN, 11, 11, 1.5);
+        cvPow(&mu, &mu_sq, 2);
+        cvSmooth(&image_sq, &sigma_sq, CV_GAUSSIAN, 11, 11, 1.5);
+        cvAddWeighted(&sigma_sq, 1, &mu_sq, -1, 0, &sigma_sq);
+    }
+#endif
+
+    list_frame(*this);
+}
+
+void
+FrameData::recycle(const std::string& path)
+{
+    unlist_frame(*this);
+    if (_decoded != NULL) cvReleaseImage(&_decoded);
+    _path = path;
+    _loaded = false;
+    _fingerprinted = false;
+#ifdef SAMPLING_SIZE
+    _summed = false;
+#endif
 }
 
 bool
 FrameData::unload()
 {
-    if (_loaded)
+    if (_loaded || !_image.empty()) // a recycled frame keeps its buffers until it is loaded again
     {
 #ifdef DEBUG
         std::cout << "Unloading frame " << _path << std::endl;
 #endif
 
         _loaded = false;
-        if (_image != NULL) cvReleaseImage(&_image);
+        unlist_frame(*this); // before its buffers go, so no frame shares them afterwards
+        _image.release(); // the buffers go back to the pool for the next frame loaded
+        if (_decoded != NULL) cvReleaseImage(&_decoded);
 #ifndef SAMPLING_SIZE
-        if (_image_sq != NULL) cvReleaseImage(&_image_sq);
-        if (_mu != NULL) cvReleaseImage(&_mu);
-        if (_mu_sq != NULL) cvReleaseImage(&_mu_sq);
-        if (_sigma_sq != NULL) cvReleaseImage(&_sigma_sq);
+        _image_sq.release();
+        _mu.release();
+        _mu_sq.release();
+        _sigma_sq.release();
+#else
+        _summed = false;
+        std::vector<double>().swap(_sum_y);
+        std::vector<double>().swap(_sum_y_sq);
 #endif
         return true;
     }
     return false;
 }
 
+bool
+FrameData::identical(const FrameData& other) const
+{
+    return !_image.empty() && _image_content == other._image_content && _image.equals(other._image);
+}
+
+static pthread_mutex_t fingerprint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool
+FrameData::fingerprint()
+{
+    // threads that ask for the same fingerprint at once may both compute it, and the first one stores it
+    if (!*(volatile bool*)&_fingerprinted)
+    {
+        IplImage* image = cvLoadImage(_path.c_str());
+        if (image == NULL)
+            return false;
+
+        uint64_t content = content_hash(image);
+
+        // shrink the luminance to one more column than the thumbnail, so that every pixel of the
+        // thumbnail has a right neighbour for the hash
+        IplImage* gray = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
+        cvCvtColor(image, gray, CV_BGR2GRAY);
+        cvReleaseImage(&image);
+        IplImage* small = cvCreateImage(cvSize(FP_SIZE + 1, FP_SIZE), IPL_DEPTH_8U, 1);
+        cvResize(gray, small, CV_INTER_AREA);
+        cvReleaseImage(&gray);
+
+        uint64_t hash = 0;
+        unsigned char thumb[FP_SIZE * FP_SIZE];
+        for (int y = 0; y < FP_SIZE; y++)
+        {
+            unsigned char* row = (unsigned char*)(small->imageData + y * small->widthStep);
+            for (int x = 0; x < FP_SIZE; x++)
+            {
+                thumb[y * FP_SIZE + x] = row[x];
+                hash = (hash << 1) | (row[x] < row[x + 1]);
+            }
+        }
+        cvReleaseImage(&small);
+
+        pthread_mutex_lock(&fingerprint_lock);
+        if (!_fingerprinted)
+        {
+            _content = content;
+            _hash = hash;
+            memcpy(_thumb, thumb, sizeof(thumb));
+            __sync_synchronize(); // the fingerprint is stored before it is marked as computed
+            _fingerprinted = true;
+        }
+        pthread_mutex_unlock(&fingerprint_lock);
+    }
+    __sync_synchronize();
+    return true;
+}
+
+#ifdef SAMPLING_SIZE
+static pthread_mutex_t sum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+FrameData::sum_luminance()
+{
+    // threads that ask for the tables at once may both compute them, and the first one stores them
+    if (!*(volatile bool*)&_summed)
+    {
+        int width = _image._width, height = _image._height;
+        size_t stride = width + 1;
+        std::vector<double> sum((height + 1) * stride, 0.0), sum_sq((height + 1) * stride, 0.0);
+        for (int y = 0; y < height; y++)
+        {
+            const float* p = _image.row(0, y);
+            double row = 0, row_sq = 0;
+            for (int x = 0; x < width; x++)
+            {
+                float sq = p[x] * p[x]; // rounded to a float, as window_averages does
+                row += p[x];
+                row_sq += sq;
+                sum[(y + 1) * stride + x + 1] = sum[y * stride + x + 1] + row;
+                sum_sq[(y + 1) * stride + x + 1] = sum_sq[y * stride + x + 1] + row_sq;
+            }
+        }
+
+        pthread_mutex_lock(&sum_lock);
+        if (!_summed)
+        {
+            _sum_y.swap(sum);
+            _sum_y_sq.swap(sum_sq);
+            __sync_synchronize(); // the tables are stored before they are marked as computed
+            _summed = true;
+        }
+        pthread_mutex_unlock(&sum_lock);
+    }
+    __sync_synchronize();
+}
+#endif
+
+double
+wall_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+SearchOptions::SearchOptions()
+    : _epsilon(0.0), _compare(false), _deadline(0.0), _band(30), _lag(60), _stream(false), _anchors(0.0), _threads(4), _lazy(false), _proxy(false), _fast(false), _quiet(false), _runs(-1.0), _scheduler(NULL)
+{
+}
+
+SearchResult::SearchResult()
+    : _sum(0), _lower(0), _length(0), _score_lower(0), _score_upper(0), _expansions(0), _timed_out(false)
+{
+}
+
+void
+SearchResult::set(score_t sum, score_t lower, uint32_t length, frame_t n1, frame_t n2)
+{
+    _sum = sum;
+    _lower = lower;
+    _length = length;
+    if (length == 0)
+    {
+        _score_lower = _score_upper = 1.0; // two empty videos are the same
+        return;
+    }
+    _score_lower = _score_upper = 1.0 - sum / length;
+    if (lower < sum)
+    {
+        // an optimal path has cost in [lower, sum]. its length is at least max(n1, n2), and since
+        // every insert and delete costs at least c, it has at most sum / c of them, so its length
+        // is at most (n1 + n2 + sum / c) / 2.
+        score_t c = min(1.0 - INSERTED_FRAME, 1.0 - DELETED_FRAME);
+        score_t max_length = n1 + n2;
+        if (c > 0)
+            max_length = min(max_length, (n1 + n2 + sum / c) / 2);
+        _score_lower = 1.0 - sum / max(n1, n2);
+        _score_upper = 1.0 - lower / max_length;
+    }
+}
+
 VQATS::VQATS()
-    : _num_videos(0)
+    : _num_videos(0), _frame_scores(0), _frame_bounds(0), _frame_prunes(0), _memo_lookups(0), _memo_hits(0), _proxy_scores(0), _identical_scores(0), _bands(NULL)
+{
+    pthread_rwlock_init(&_memo_lock, NULL);
+}
+
+CacheShard::CacheShard()
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_loaded, NULL);
+}
+
+CacheShard::CacheShard(const CacheShard& shard)
+    : _frames(shard._frames)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_loaded, NULL);
+}
+
+CacheShard::~CacheShard()
 {
+    pthread_cond_destroy(&_loaded);
+    pthread_mutex_destroy(&_lock);
+}
+
+VideoData::VideoData()
+    : _shards(CACHE_SHARDS), _base(0), _cache_size(CACHE_SIZE), _stream(NULL)
+{
+}
+
+VideoData::VideoData(const VideoData& video)
+    : _frames(video._frames), _shards(video._shards), _base(video._base), _cache_size(video._cache_size), _stream(NULL)
+{
+}
+
+VideoData::~VideoData()
+{
+    delete _stream;
 }
 
 VQATS::~VQATS()
 {
+    for (ScoreMemo::iterator it = _score_memo.begin(); it != _score_memo.end(); ++it)
+        delete it->second;
+    pthread_rwlock_destroy(&_memo_lock);
+}
+
+void
+VQATS::reset_counters(unsigned long frame_scores, unsigned long memo_lookups, unsigned long memo_hits)
+{
+    _frame_scores = frame_scores;
+    _memo_lookups = memo_lookups;
+    _memo_hits = memo_hits;
+}
+
+void
+VQATS::add_counters(unsigned long frame_scores, unsigned long memo_lookups, unsigned long memo_hits,
+                    unsigned long frame_bounds, unsigned long frame_prunes, unsigned long identical_scores)
+{
+    __sync_fetch_and_add(&_frame_scores, frame_scores);
+    __sync_fetch_and_add(&_memo_lookups, memo_lookups);
+    __sync_fetch_and_add(&_memo_hits, memo_hits);
+    __sync_fetch_and_add(&_frame_bounds, frame_bounds);
+    __sync_fetch_and_add(&_frame_prunes, frame_prunes);
+    __sync_fetch_and_add(&_identical_scores, identical_scores);
 }
 
 video_t
@@ -141,7 +610,7 @@ VQATS::load_video(std::string filename)
         {
             FrameData frame_data;
             frame_data._path = s;
-            frame_data._index = index++;
+            frame_data._index = frame_data._run = index++;
             _video_map[id]._frames.push_back(frame_data);
 #ifdef DEBUG
             std::cout << "Initialized frame " << s << " for sequence " << filename << std::endl;
@@ -152,92 +621,507 @@ VQATS::load_video(std::string filename)
     return id;
 }
 
+video_t
+VQATS::add_video(const std::vector<std::string>& paths)
+{
+    video_t id = ++_num_videos;
+    for (frame_t index = 0; index < paths.size(); index++)
+    {
+        FrameData frame_data;
+        frame_data._path = paths[index];
+        frame_data._index = frame_data._run = index;
+        _video_map[id]._frames.push_back(frame_data);
+    }
+    return id;
+}
+
+video_t
+VQATS::open_video(std::string filename)
+{
+    std::ifstream* fs = new std::ifstream(filename.c_str());
+    if (fs->fail())
+    {
+        std::cout << "Unable to load video file " << filename << std::endl;
+        delete fs;
+        return 0;
+    }
+    video_t id = ++_num_videos;
+    _video_map[id]._stream = fs;
+    return id;
+}
+
 bool
-VQATS::load_video_frame(const video_t& video_index, const frame_t& frame_index)
+VQATS::stream_frame(const video_t& video_index, const frame_t& frame_index)
+{
+    VideoData& video = _video_map[video_index];
+    while (video._base + video._frames.size() <= frame_index)
+    {
+        // blocks until the writer adds a line or closes the list
+        std::string s;
+        if (video._stream == NULL || !(*video._stream >> s))
+        {
+            delete video._stream;
+            video._stream = NULL;
+            return false;
+        }
+        FrameData frame_data;
+        frame_data._path = s;
+        frame_data._index = frame_data._run = video._base + video._frames.size();
+        video._frames.push_back(frame_data);
+#ifdef DEBUG
+        std::cout << "Initialized frame " << s << " for stream " << video_index << std::endl;
+#endif
+    }
+    return true;
+}
+
+void
+VQATS::release_frames(const video_t& video_index, const frame_t& frame_index)
+{
+    VideoData& video = _video_map[video_index];
+    for (int k = 0; k < CACHE_SHARDS; k++)
+    {
+        std::list<frame_t>& frames = video._shards[k]._frames;
+        for (std::list<frame_t>::iterator it = frames.begin(); it != frames.end(); )
+        {
+            if (*it < frame_index)
+                it = frames.erase(it);
+            else
+                ++it;
+        }
+    }
+    while (video._base < frame_index && !video._frames.empty())
+    {
+        video._frames.pop_front(); // unloads the frame
+        video._base++;
+    }
+}
+
+void
+VQATS::unload_video(const video_t& video_index)
 {
     VideoData& video = _video_map[video_index];
-    // we have a LRU cache replacement policy
-    // check if this frame is already in the cache
+    for (int k = 0; k < CACHE_SHARDS; k++)
+    {
+        std::list<frame_t>& frames = video._shards[k]._frames;
+        for (std::list<frame_t>::iterator it = frames.begin(); it != frames.end(); ++it)
+            video.frame(*it).unload();
+        frames.clear();
+    }
+    for (ScoreMemo::iterator it = _score_memo.begin(); it != _score_memo.end(); )
+    {
+        if (it->first.first == video_index || it->first.second == video_index)
+        {
+            delete it->second;
+            _score_memo.erase(it++);
+        }
+        else
+            ++it;
+    }
+}
+
+// most frames of a shard, so that the shards together hold the frames of the cache
+static inline size_t shard_size(const VideoData& video)
+{
+    return max((video._cache_size + CACHE_SHARDS - 1) / CACHE_SHARDS, (frame_t)1);
+}
+
+// unloads the least recently used frames of the shard that are not pinned until it fits. the lock is held.
+static void trim_shard(VideoData& video, CacheShard& shard)
+{
+    size_t size = shard_size(video);
+    for (std::list<frame_t>::iterator it = shard._frames.begin(); shard._frames.size() > size && it != shard._frames.end(); )
+    {
+        FrameData& frame = video.frame(*it);
+        if (frame._pins == 0 && !frame._loading)
+        {
+            frame.unload();
+            it = shard._frames.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void
+VQATS::remove_video(const video_t& video_index)
+{
+    unload_video(video_index);
+    _video_map.erase(video_index);
+}
+
+void
+VQATS::set_cache_size(const video_t& video_index, frame_t frames)
+{
+    VideoData& video = _video_map[video_index];
+    video._cache_size = max(frames, (frame_t)1);
+    for (int k = 0; k < CACHE_SHARDS; k++)
+    {
+        pthread_mutex_lock(&video._shards[k]._lock);
+        trim_shard(video, video._shards[k]);
+        pthread_mutex_unlock(&video._shards[k]._lock);
+    }
+}
+
+frame_t
+VQATS::loaded_frames(const video_t& video_index)
+{
+    VideoData& video = _video_map[video_index];
+    frame_t frames = 0;
+    for (int k = 0; k < CACHE_SHARDS; k++)
+    {
+        pthread_mutex_lock(&video._shards[k]._lock);
+        frames += video._shards[k]._frames.size();
+        pthread_mutex_unlock(&video._shards[k]._lock);
+    }
+    return frames;
+}
+
+frame_t
+VQATS::memo_frames(const video_t& video_index)
+{
+    size_t bytes = 0;
+    pthread_rwlock_rdlock(&_memo_lock);
+    for (ScoreMemo::iterator it = _score_memo.lower_bound(std::make_pair(video_index, (video_t)0));
+         it != _score_memo.end() && it->first.first == video_index; ++it)
+        bytes += it->second->bytes();
+    pthread_rwlock_unlock(&_memo_lock);
+    if (bytes == 0) return 0;
+
+    // the size of a frame is that of any loaded one. a memo outliving every frame counts as one frame, so that
+    // the video is still unloaded with the others
+    VideoData& video = _video_map[video_index];
+    size_t frame_bytes = 0;
+    for (int k = 0; k < CACHE_SHARDS && frame_bytes == 0; k++)
+    {
+        pthread_mutex_lock(&video._shards[k]._lock);
+        if (!video._shards[k]._frames.empty())
+        {
+            FrameData& frame = video.frame(video._shards[k]._frames.front());
+            frame_bytes = frame._image.bytes();
+#ifndef SAMPLING_SIZE
+            frame_bytes += frame._image_sq.bytes() + frame._mu.bytes() + frame._mu_sq.bytes() + frame._sigma_sq.bytes();
+#endif
+        }
+        pthread_mutex_unlock(&video._shards[k]._lock);
+    }
+    return frame_bytes == 0 ? 1 : (frame_t)((bytes + frame_bytes - 1) / frame_bytes);
+}
+
+FrameHandle
+VQATS::acquire_frame(const video_t& video_index, const frame_t& frame_index)
+{
+    // we have a LRU cache replacement policy in each shard. the frame is pinned under the lock of its shard, and
+    // frames are unloaded only under that lock, so a pinned frame stays loaded. the image is loaded outside the
+    // lock, and other threads asking for it meanwhile wait for it.
+    VideoData& video = _video_map.find(video_index)->second;
+    FrameData& frame = video.frame(frame_index);
+    CacheShard& shard = video._shards[frame_index % CACHE_SHARDS];
+    pthread_mutex_lock(&shard._lock);
+    while (frame._loading)
+        pthread_cond_wait(&shard._loaded, &shard._lock);
     bool found = false;
-    VideoData::CacheList::iterator slot = video._cache.begin();
-    // if (video_index != 1) for (int i = 0; i < (int)video._cache.size() - 1; i++) slot++; // do MRU for videos other than first one
-    for (VideoData::CacheList::iterator it = video._cache.begin(); it != video._cache.end(); ++it)
+    for (std::list<frame_t>::iterator it = shard._frames.begin(); it != shard._frames.end(); ++it)
     {
         if (*it == frame_index)
         {
-            slot = it;
+            shard._frames.erase(it);
             found = true;
             break;
         }
     }
-    if (video._cache.size() >= CACHE_SIZE || found)
-    {
-        if (!found)
-            video._frames[*slot].unload();
-        video._cache.erase(slot);
-    }
-    video._cache.push_back(frame_index);
+    shard._frames.push_back(frame_index);
+    __sync_fetch_and_add(&frame._pins, 1);
+    if (!found)
+        frame._loading = true;
+    trim_shard(video, shard);
 #ifdef DEBUG
     // debug output for cache list
     std::cout << "Cache List: ";
-    for (VideoData::CacheList::iterator it = video._cache.begin(); it != video._cache.end(); ++it)
+    for (std::list<frame_t>::iterator it = shard._frames.begin(); it != shard._frames.end(); ++it)
         std::cout << *it << " ";
     std::cout << std::endl;
 #endif
+    pthread_mutex_unlock(&shard._lock);
+
     if (!found)
-        return video._frames[frame_index].load();
-    else
-        return true; // was already in cache
+    {
+        frame.load();
+        pthread_mutex_lock(&shard._lock);
+        frame._loading = false;
+        pthread_cond_broadcast(&shard._loaded);
+        pthread_mutex_unlock(&shard._lock);
+    }
+    return FrameHandle(&frame);
+}
+
+frame_t
+VQATS::collapse_runs(const video_t& video_index, double tolerance)
+{
+    VideoData& video = _video_map[video_index];
+    frame_t repeats = 0;
+    for (frame_t i = 1; i < video._frames.size(); i++)
+    {
+        FrameData& first = video.frame(video.frame(i - 1)._run);
+        FrameData& frame = video.frame(i);
+        if (!first.fingerprint() || !frame.fingerprint())
+            continue;
+        // compare with the first frame of the run, so that slow changes do not add up
+        bool same = first._content == frame._content;
+        if (!same && tolerance > 0)
+        {
+            int diff = 0;
+            for (int k = 0; k < FP_SIZE * FP_SIZE; k++)
+                diff += abs(first._thumb[k] - frame._thumb[k]);
+            same = diff <= tolerance * FP_SIZE * FP_SIZE;
+        }
+        if (same)
+        {
+            frame._run = first._index;
+            frame._repeated = first._repeated = true;
+            repeats++;
+        }
+    }
+    return repeats;
+}
+
+VQATS::ScoreTable*
+VQATS::score_table(const video_t& video1, const video_t& video2)
+{
+    pthread_rwlock_rdlock(&_memo_lock);
+    ScoreMemo::iterator it = _score_memo.find(std::make_pair(video1, video2));
+    ScoreTable* table = it != _score_memo.end() ? it->second : NULL;
+    pthread_rwlock_unlock(&_memo_lock);
+    if (table == NULL)
+    {
+        pthread_rwlock_wrlock(&_memo_lock);
+        ScoreTable*& entry = _score_memo[std::make_pair(video1, video2)];
+        if (entry == NULL)
+            entry = new ScoreTable();
+        table = entry;
+        pthread_rwlock_unlock(&_memo_lock);
+    }
+    return table;
 }
 
 score_t
-VQATS::compute_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2)
+VQATS::compute_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2, score_t cutoff)
 {
-    if (!load_video_frame(video1, index1)) return 0.0;
-    if (!load_video_frame(video2, index2)) return 0.0;
+    frame_t run1 = _video_map.find(video1)->second.frame(index1)._run;
+    frame_t run2 = _video_map.find(video2)->second.frame(index2)._run;
+    // the first frames of the runs stand for the others. every engine asks for frame scores through here, so
+    // a score is computed once however many times, from whichever direction, it is asked for. threads that
+    // ask for the same score at once may both compute it.
+    ScoreTable* table = score_table(video1, video2);
+    __sync_fetch_and_add(&_memo_lookups, 1);
+    pthread_rwlock_rdlock(&_memo_lock);
+    float* memo = table->find(run1, run2);
+    score_t remembered = memo != NULL ? *memo : 0.0;
+    pthread_rwlock_unlock(&_memo_lock);
+    if (memo != NULL)
+    {
+        __sync_fetch_and_add(&_memo_hits, 1);
+        return remembered;
+    }
+    score_t score = compute_ssim(video1, video2, run1, run2, cutoff);
+    if (score < cutoff)
+        return score; // may be a bound only
+    score = (float)score; // the same score whether computed or remembered
+    pthread_rwlock_wrlock(&_memo_lock);
+    if (table->size() < MEMO_SIZE)
+        table->insert(run1, run2) = score;
+    pthread_rwlock_unlock(&_memo_lock);
+    return score;
+}
 
-    FrameData& frame1 = _video_map[video1]._frames[index1];
-    FrameData& frame2 = _video_map[video2]._frames[index2];
-    
-    // assert some properties about the frames we are comparing
-    assert(frame1._size.width == frame2._size.width);
-    assert(frame1._size.height == frame2._size.height);
-    assert(frame1._depth == frame2._depth);
-    assert(frame1._nChannels == frame2._nChannels);
+// frame pairs of one tile, scored by a task of score_pairs
+struct ScoreTask
+{
+    VQATS* _v;
+    video_t _video1, _video2;
+    const std::vector<std::pair<frame_t, frame_t> >* _pairs;
+    std::vector<score_t>* _scores;
+    std::vector<size_t> _slots; // pairs of the tile
+};
 
-#ifdef SAMPLING_SIZE
+static void score_task(void* arg)
+{
+    ScoreTask* task = (ScoreTask*)arg;
+    for (size_t k = 0; k < task->_slots.size(); k++)
+    {
+        const std::pair<frame_t, frame_t>& pair = (*task->_pairs)[task->_slots[k]];
+        (*task->_scores)[task->_slots[k]] = task->_v->compute_frame_score(task->_video1, task->_video2, pair.first, pair.second);
+    }
+}
+
+void
+VQATS::score_pairs(const video_t& video1, const video_t& video2, const std::vector<std::pair<frame_t, frame_t> >& pairs,
+                   std::vector<score_t>& scores, Scheduler& scheduler)
+{
+    // pairs are grouped by tile of first frames of runs, so that a task needs few frames, and each tile becomes a task
+    VideoData& data1 = _video_map.find(video1)->second;
+    VideoData& data2 = _video_map.find(video2)->second;
+    typedef std::map<std::pair<frame_t, frame_t>, ScoreTask> TileMap;
+    TileMap tiles;
+    scores.resize(pairs.size());
+    for (size_t k = 0; k < pairs.size(); k++)
+    {
+        frame_t run1 = data1.frame(pairs[k].first)._run, run2 = data2.frame(pairs[k].second)._run;
+        ScoreTask& task = tiles[std::make_pair(run1 / SCORE_TILE, run2 / SCORE_TILE)];
+        task._slots.push_back(k);
+    }
 
-    // compute a random seed based on paths of frames. we try to make sure it is commutative.
+    // each thread works on a tile at a time, which needs SCORE_TILE frames of each video. the caches hold the tiles
+    // of every thread, and one more per shard as the frames of a tile may fall unevenly across the shards, so that
+    // threads do not evict the frames of each other
+    frame_t cache1 = data1._cache_size, cache2 = data2._cache_size;
+    frame_t needed = (scheduler.threads() + 1 + CACHE_SHARDS) * SCORE_TILE;
+    set_cache_size(video1, max(cache1, needed));
+    set_cache_size(video2, max(cache2, needed));
+
+    TaskGroup group;
+    for (TileMap::iterator it = tiles.begin(); it != tiles.end(); ++it)
+    {
+        ScoreTask& task = it->second;
+        task._v = this;
+        task._video1 = video1;
+        task._video2 = video2;
+        task._pairs = &pairs;
+        task._scores = &scores;
+        scheduler.spawn(group, score_task, &task);
+    }
+    scheduler.wait(group);
+    set_cache_size(video1, cache1);
+    set_cache_size(video2, cache2);
+}
+
+#ifdef SAMPLING_SIZE
+// compute a random seed based on paths of frames. we try to make sure it is commutative.
+static unsigned int sampling_seed(FrameData& frame1, FrameData& frame2)
+{
     unsigned int seed1 = 0, seed2 = 0, m = 30011; // just some prime
     for (std::string::iterator it = frame1._path.begin(); it != frame1._path.end(); ++it)
         seed1 = seed1 * m + *it;
     for (std::string::iterator it = frame2._path.begin(); it != frame2._path.end(); ++it)
         seed2 = seed2 * m + *it;
-    srand(seed1 + seed2); // initialize with this random seed
-
-    unsigned int sx = SAMPLING_WIN_X, sy = SAMPLING_WIN_Y, // window size
-                 rangex = frame1._size.width - sx + 1, rangey = frame1._size.height - sy + 1; // range of valid x and y
-    CvMat *image1 = cvCreateMat(sx, sy, CV_32FC3), *image2 = cvCreateMat(sx, sy, CV_32FC3),
-          *image1_sq = cvCreateMat(sx, sy, CV_32FC3), *image2_sq = cvCreateMat(sx, sy, CV_32FC3),
-          *image_product = cvCreateMat(sx, sy, CV_32FC3);
-    
+    return seed1 + seed2;
+}
+
+// the sequence of srand and rand, from a state of its own, so that frame scores can be computed on several threads
+struct SamplingRandom
+{
+    SamplingRandom(unsigned int seed)
+    {
+        memset(&_data, 0, sizeof(_data));
+        initstate_r(seed, _state, sizeof(_state), &_data); // the size of the state of rand
+    }
+    int next()
+    {
+        int32_t r;
+        random_r(&_data, &r);
+        return r;
+    }
+
+    struct random_data _data;
+    char _state[128];
+};
+
+// averages over the window at (x0, y0) of both frames, of their squares and of their products, by channel.
+// squares and products are rounded to floats before they are summed, as in the float images they were once
+// computed in, so that the averages are the same.
+static void window_averages(const FrameBuffer& image1, const FrameBuffer& image2, int x0, int y0,
+                            CvScalar& mu1, CvScalar& mu2, CvScalar& sq1, CvScalar& sq2, CvScalar& product)
+{
+    double n = SAMPLING_WIN_X * SAMPLING_WIN_Y;
+    mu1 = mu2 = sq1 = sq2 = product = cvScalarAll(0);
+    for (int c = 0; c < image1._channels; c++)
+    {
+        double s1 = 0, s2 = 0, s11 = 0, s22 = 0, s12 = 0;
+        for (int y = y0; y < y0 + SAMPLING_WIN_Y; y++)
+        {
+            const float *p1 = image1.row(c, y) + x0, *p2 = image2.row(c, y) + x0;
+            for (int x = 0; x < SAMPLING_WIN_X; x++)
+            {
+                float a = p1[x], b = p2[x], aa = a * a, bb = b * b, ab = a * b;
+                s1 += a;
+                s2 += b;
+                s11 += aa;
+                s22 += bb;
+                s12 += ab;
+            }
+        }
+        mu1.val[c] = s1 / n;
+        mu2.val[c] = s2 / n;
+        sq1.val[c] = s11 / n;
+        sq2.val[c] = s22 / n;
+        product.val[c] = s12 / n;
+    }
+}
+
+// averages over the window at (x0, y0) of the luminance of a frame and of its square, from its summed-area tables.
+// the sums are of whole numbers, so they are exact and the averages those of window_averages. the other channels
+// are left at 0, which gives them an SSIM of 1, the most it can be.
+static void window_luminance(const FrameData& frame, int x0, int y0, CvScalar& mu, CvScalar& sq)
+{
+    double n = SAMPLING_WIN_X * SAMPLING_WIN_Y;
+    size_t stride = frame._image._width + 1, top = y0 * stride + x0, bottom = (y0 + SAMPLING_WIN_Y) * stride + x0;
+    const std::vector<double> &sum = frame._sum_y, &sum_sq = frame._sum_y_sq;
+    mu = sq = cvScalarAll(0);
+    mu.val[0] = (sum[bottom + SAMPLING_WIN_X] - sum[bottom] - sum[top + SAMPLING_WIN_X] + sum[top]) / n;
+    sq.val[0] = (sum_sq[bottom + SAMPLING_WIN_X] - sum_sq[bottom] - sum_sq[top + SAMPLING_WIN_X] + sum_sq[top]) / n;
+}
+
+// averages the SSIM of SAMPLING_SIZE windows of two frames, drawn the same way for every score of the pair, or
+// with bound, an upper bound on the SSIM of each window from the luminance of each frame alone, which needs their
+// summed-area tables. with a cutoff, the average is given up as soon as the windows left cannot bring it up to
+// the cutoff, returning that bound.
+static CvScalar sample_windows(FrameData& frame1, FrameData& frame2, bool bound, score_t cutoff, bool& pruned)
+{
+    SamplingRandom sampler(sampling_seed(frame1, frame2));
+
+    unsigned int rangex = frame1._image._width - SAMPLING_WIN_X + 1, rangey = frame1._image._height - SAMPLING_WIN_Y + 1; // range of valid x and y
+
     CvScalar index_scalar = cvScalar(0.0, 0.0, 0.0, 0.0);
     double total_weight = 0.0;
+    pruned = false;
     for (unsigned int i = 0; i < SAMPLING_SIZE; i++)
     {
-        unsigned int rx = rand() % rangex, ry = rand() % rangey; // random sample position
-        
-        image1 = cvGetSubRect(frame1._image, image1, cvRect(rx, ry, sx, sy));
-        image2 = cvGetSubRect(frame2._image, image2, cvRect(rx, ry, sx, sy));
-        cvPow(image1, image1_sq, 2);
-        cvPow(image2, image2_sq, 2);
-        CvScalar mu1 = cvAvg(image1), mu2 = cvAvg(image2), 
-                 mu1_sq = mu1 * mu1, mu2_sq = mu2 * mu2,
-                 sigma1_sq = cvAvg(image1_sq) - mu1_sq, sigma2_sq = cvAvg(image2_sq) - mu2_sq;
-        cvMul(image1, image2, image_product, 1.0);
+        if (cutoff > -1.0 && i > 0 && i % ((SAMPLING_SIZE + SCORE_STRIPES - 1) / SCORE_STRIPES) == 0)
+        {
+            // every window left has a weight and a score of at most 1, which bounds the average
+            double left = SAMPLING_SIZE - i;
+            score_t upper = (index_scalar.val[0] * W_Y + index_scalar.val[1] * W_Cr + index_scalar.val[2] * W_Cb + left) /
+                (total_weight + left);
+            if (upper < cutoff)
+            {
+                pruned = true;
+                return cvScalarAll(upper);
+            }
+        }
+
+        unsigned int rx = sampler.next() % rangex, ry = sampler.next() % rangey; // random sample position
+
+        CvScalar mu1, mu2, sq1, sq2, product;
+        if (bound)
+        {
+            window_luminance(frame1, rx, ry, mu1, sq1);
+            window_luminance(frame2, rx, ry, mu2, sq2);
+        }
+        else
+            window_averages(frame1._image, frame2._image, rx, ry, mu1, mu2, sq1, sq2, product);
+        CvScalar mu1_sq = mu1 * mu1, mu2_sq = mu2 * mu2,
+                 sigma1_sq = sq1 - mu1_sq, sigma2_sq = sq2 - mu2_sq;
         CvScalar mu_product = mu1 * mu2;
-        CvScalar sigma_cross = cvAvg(image_product) - mu_product;
-        
+        CvScalar sigma_cross;
+        if (bound)
+        {
+            // the covariance is at most the product of the deviations
+            for (int c = 0; c < 4; c++)
+                sigma_cross.val[c] = sqrt(max(sigma1_sq.val[c], 0.0) * max(sigma2_sq.val[c], 0.0));
+        }
+        else
+            sigma_cross = product - mu_product;
+
         CvScalar numerator = (2.0 * mu_product + C1) * (2.0 * sigma_cross + C2);
         CvScalar denominator = (mu1_sq + mu2_sq + C1) * (sigma1_sq + sigma2_sq + C2);
         CvScalar ssim = numerator / denominator;
@@ -248,75 +1132,232 @@ VQATS::compute_frame_score(const video_t& video1, const video_t& video2, const f
                    (mu1.val[0] - 40) / 10;
         index_scalar += ssim * w;
         total_weight += w;
-#else        
+#else
         index_scalar += ssim;
         total_weight += 1;
 #endif
     }
-    
+
     index_scalar /= total_weight;
-    
-    // clean up
-    cvReleaseMat(&image1);
-    cvReleaseMat(&image2);
-    cvReleaseMat(&image1_sq);
-    cvReleaseMat(&image2_sq);
-    cvReleaseMat(&image_product);
+    return index_scalar;
+}
+#endif
+
+score_t
+VQATS::bound_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2)
+{
+    __sync_fetch_and_add(&_frame_bounds, 1);
+#ifdef SAMPLING_SIZE
+
+    frame_t first1 = _video_map.find(video1)->second.frame(index1)._run;
+    frame_t first2 = _video_map.find(video2)->second.frame(index2)._run;
+    FrameHandle handle1 = acquire_frame(video1, first1);
+    FrameHandle handle2 = acquire_frame(video2, first2);
+    if (!handle1.loaded() || !handle2.loaded()) return 1.0;
+
+    FrameData& frame1 = *handle1;
+    FrameData& frame2 = *handle2;
+    if (frame1.identical(frame2)) return 1.0;
+
+    // the SSIM of a window is l * cs, the luminance term times the contrast-structure term. since the
+    // covariance is at most the product of the deviations, cs <= (2 sigma1 sigma2 + C2) / (sigma1^2 + sigma2^2 + C2),
+    // which needs the means and deviations of each frame alone. these come from tables summed once per frame,
+    // so that a bound costs a few lookups per window rather than a pass over its pixels
+    frame1.sum_luminance();
+    frame2.sum_luminance();
+    bool pruned;
+    CvScalar index_scalar = sample_windows(frame1, frame2, true, -INF, pruned); // the same windows as compute_frame_score
+    return index_scalar.val[0] * W_Y + index_scalar.val[1] * W_Cr + index_scalar.val[2] * W_Cb;
 
 #else
 
-    // perform SSIM computation
-    IplImage *image_product = NULL,
-             *mu_product = NULL,
-             *sigma_cross = NULL,
-             *numerator = NULL,
-             *denominator = NULL,
-             *ssim_map = NULL,
-             *temp1 = NULL,
-             *temp2 = NULL;
-
-    CvSize size = frame1._size;
-    int depth = frame1._depth;
-    int nChannels = frame1._nChannels;
-
-    image_product = cvCreateImage(size, depth, nChannels);
-    mu_product = cvCreateImage(size, depth, nChannels);
-    sigma_cross = cvCreateImage(size, depth, nChannels);
-    temp1 = cvCreateImage(size, depth, nChannels);
-    temp2 = cvCreateImage(size, depth, nChannels);
-    numerator = cvCreateImage(size, depth, nChannels);
-    denominator = cvCreateImage(size, depth, nChannels);
-    ssim_map = cvCreateImage(size, depth, nChannels);
-
-    cvMul(frame1._image, frame2._image, image_product, 1);
-    cvMul(frame1._mu, frame2._mu, mu_product, 2); // scale by 2 to save one computation. note: mu_product is twice its actual value.
-
-    cvSmooth(image_product, sigma_cross, CV_GAUSSIAN, 11, 11, 1.5);
-    cvAddWeighted(sigma_cross, 2, mu_product, -1, C2, temp2); // scale by 2, add C2 to save two computations. note: mu_product is twice actual value, due to above.
-
-    cvAddS(mu_product, cvScalarAll(C1), temp1); // note: mu_product is twice actual value, due to above.
-    cvMul(temp1, temp2, numerator, 1);
-
-    cvAdd(frame1._mu_sq, frame2._mu_sq, temp1);
-    cvAddS(temp1, cvScalarAll(C1), temp1);
-
-    cvAdd(frame1._sigma_sq, frame2._sigma_sq, temp2);
-    cvAddS(temp2, cvScalarAll(C2), temp2);
-
-    cvMul(temp1, temp2, denominator, 1);
-
-    cvDiv(numerator, denominator, ssim_map, 1);
-    CvScalar index_scalar = cvAvg(ssim_map);
-
-    // cleanup
-    cvReleaseImage(&image_product);
-    cvReleaseImage(&mu_product);
-    cvReleaseImage(&sigma_cross);
-    cvReleaseImage(&numerator);
-    cvReleaseImage(&denominator);
-    cvReleaseImage(&ssim_map);
-    cvReleaseImage(&temp1);
-    cvReleaseImage(&temp2);
+    // a bound from the SSIM maps would cost as much as the score itself, so full SSIM builds take the best
+    // score, which only defers scoring until the move reaches the top of the queue
+    return 1.0;
+
+#endif
+}
+
+score_t
+VQATS::proxy_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2)
+{
+    FrameData& frame1 = _video_map.find(video1)->second.frame(index1);
+    FrameData& frame2 = _video_map.find(video2)->second.frame(index2);
+    __sync_fetch_and_add(&_proxy_scores, 1);
+    if (!frame1.fingerprint() || !frame2.fingerprint()) return 0.0;
+
+    // luminance SSIM of the thumbnails, one window per tile
+    const int n = PROXY_WIN * PROXY_WIN;
+    double total = 0.0;
+    int windows = 0;
+    for (int y0 = 0; y0 < FP_SIZE; y0 += PROXY_WIN)
+    {
+        for (int x0 = 0; x0 < FP_SIZE; x0 += PROXY_WIN)
+        {
+            double s1 = 0, s2 = 0, s11 = 0, s22 = 0, s12 = 0;
+            for (int y = y0; y < y0 + PROXY_WIN; y++)
+            {
+                for (int x = x0; x < x0 + PROXY_WIN; x++)
+                {
+                    double p1 = frame1._thumb[y * FP_SIZE + x], p2 = frame2._thumb[y * FP_SIZE + x];
+                    s1 += p1;
+                    s2 += p2;
+                    s11 += p1 * p1;
+                    s22 += p2 * p2;
+                    s12 += p1 * p2;
+                }
+            }
+            double mu1 = s1 / n, mu2 = s2 / n;
+            double sigma1_sq = s11 / n - mu1 * mu1, sigma2_sq = s22 / n - mu2 * mu2, sigma12 = s12 / n - mu1 * mu2;
+            total += (2 * mu1 * mu2 + C1) * (2 * sigma12 + C2) / ((mu1 * mu1 + mu2 * mu2 + C1) * (sigma1_sq + sigma2_sq + C2));
+            windows++;
+        }
+    }
+    return total / windows;
+}
+
+score_t
+VQATS::compute_ssim(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2, score_t cutoff)
+{
+    __sync_fetch_and_add(&_frame_scores, 1);
+    FrameHandle handle1 = acquire_frame(video1, index1);
+    FrameHandle handle2 = acquire_frame(video2, index2);
+    if (!handle1.loaded() || !handle2.loaded()) return 0.0;
+    return frame_ssim(*handle1, *handle2, cutoff);
+}
+
+#ifndef SAMPLING_SIZE
+// averages of the SSIM map of rows y0 to y1 of two frames, by channel. the cross product is smoothed with the
+// rows the Gaussian window reaches beyond them, so that the stripes join up to the map of the whole frame.
+static CvScalar stripe_ssim(const FrameData& frame1, const FrameData& frame2, int y0, int y1)
+{
+    int width = frame1._image._width, height = frame1._image._height;
+    int m0 = max(y0 - 5, 0), m1 = min(y1 + 5, height); // 5 rows reach out of an 11x11 window
+    FrameBuffer image_product, mu_product, sigma_cross, numerator, denominator, ssim_map, temp1, temp2;
+    image_product.create(width, m1 - m0, 1);
+    sigma_cross.create(width, m1 - m0, 1);
+    mu_product.create(width, y1 - y0, 1);
+    temp1.create(width, y1 - y0, 1);
+    temp2.create(width, y1 - y0, 1);
+    numerator.create(width, y1 - y0, 1);
+    denominator.create(width, y1 - y0, 1);
+    ssim_map.create(width, y1 - y0, 1);
+
+    // the stripe images start at row m0 or y0 of the frame
+    CvScalar ssim = cvScalarAll(0);
+    for (int k = 0; k < frame1._image._channels; k++)
+    {
+        CvMat a, b, c, d, e; // row headers
+        int n = y1 - y0;
+
+        cvMul(frame1._image.rows(k, m0, m1, &a), frame2._image.rows(k, m0, m1, &b), image_product.rows(0, 0, m1 - m0, &c), 1);
+        cvSmooth(&c, sigma_cross.rows(0, 0, m1 - m0, &d), CV_GAUSSIAN, 11, 11, 1.5);
+
+        cvMul(frame1._mu.rows(k, y0, y1, &a), frame2._mu.rows(k, y0, y1, &b), mu_product.rows(0, 0, n, &c), 2); // scale by 2 to save one computation. note: mu_product is twice its actual value.
+        cvAddWeighted(sigma_cross.rows(0, y0 - m0, y1 - m0, &d), 2, &c, -1, C2, temp2.rows(0, 0, n, &e)); // scale by 2, add C2 to save two computations. note: mu_product is twice actual value, due to above.
+
+        cvAddS(&c, cvScalarAll(C1), temp1.rows(0, 0, n, &d)); // note: mu_product is twice actual value, due to above.
+        cvMul(&d, &e, numerator.rows(0, 0, n, &c), 1);
+
+        cvAdd(frame1._mu_sq.rows(k, y0, y1, &a), frame2._mu_sq.rows(k, y0, y1, &b), &d);
+        cvAddS(&d, cvScalarAll(C1), &d);
+
+        cvAdd(frame1._sigma_sq.rows(k, y0, y1, &a), frame2._sigma_sq.rows(k, y0, y1, &b), &e);
+        cvAddS(&e, cvScalarAll(C2), &e);
+
+        cvMul(&d, &e, denominator.rows(0, 0, n, &a), 1);
+
+        cvDiv(&c, &a, ssim_map.rows(0, 0, n, &b), 1);
+        ssim.val[k] = cvAvg(&b).val[0];
+    }
+    return ssim;
+}
+
+// a stripe of a frame score computed as a task
+struct StripeTask
+{
+    const FrameData* _frame1;
+    const FrameData* _frame2;
+    int _y0, _y1;
+    CvScalar _ssim;
+};
+
+static void stripe_task(void* arg)
+{
+    StripeTask* task = (StripeTask*)arg;
+    task->_ssim = stripe_ssim(*task->_frame1, *task->_frame2, task->_y0, task->_y1);
+}
+#endif
+
+score_t
+VQATS::frame_ssim(FrameData& frame1, FrameData& frame2, score_t cutoff)
+{
+    // assert some properties about the frames we are comparing
+    assert(frame1._image._width == frame2._image._width);
+    assert(frame1._image._height == frame2._image._height);
+    assert(frame1._image._channels == frame2._image._channels);
+
+    // identical frames have an SSIM of exactly 1, which the sums below only approximate
+    if (frame1.identical(frame2))
+    {
+        __sync_fetch_and_add(&_identical_scores, 1);
+        return 1.0;
+    }
+
+#ifdef SAMPLING_SIZE
+
+    bool pruned;
+    CvScalar index_scalar = sample_windows(frame1, frame2, false, cutoff, pruned);
+    if (pruned)
+        __sync_fetch_and_add(&_frame_prunes, 1);
+
+#else
+
+    // the SSIM map is computed in stripes of rows, and its average is bounded after each stripe by taking the
+    // rows left at the best score of 1. scores are never under -1, so a lower cutoff is no cutoff. with a
+    // scheduler for row bands, the stripes are bands of SCORE_BAND rows, all computed in parallel, and the
+    // bound is taken over them in order, so that the score is the same on any number of threads.
+    int height = frame1._image._height, stripes = cutoff > -1.0 ? SCORE_STRIPES : 1;
+    int rows = _bands ? SCORE_BAND : (height + stripes - 1) / stripes;
+    std::vector<StripeTask> tasks;
+    for (int y0 = 0; y0 < height; y0 += rows)
+    {
+        StripeTask task;
+        task._frame1 = &frame1;
+        task._frame2 = &frame2;
+        task._y0 = y0;
+        task._y1 = min(y0 + rows, height);
+        tasks.push_back(task);
+    }
+    if (_bands)
+    {
+        TaskGroup group;
+        for (size_t b = 0; b < tasks.size(); b++)
+            _bands->spawn(group, stripe_task, &tasks[b]);
+        _bands->wait(group);
+    }
+
+    CvScalar index_scalar = cvScalarAll(0);
+    for (size_t b = 0; b < tasks.size(); b++)
+    {
+        int y0 = tasks[b]._y0, y1 = tasks[b]._y1;
+        if (!_bands)
+            stripe_task(&tasks[b]); // one at a time, so that the stripes after a cutoff are not computed
+        for (int k = 0; k < 4; k++)
+            index_scalar.val[k] += tasks[b]._ssim.val[k] * (y1 - y0) / height;
+
+        if (y1 < height)
+        {
+            score_t upper = index_scalar.val[0] * W_Y + index_scalar.val[1] * W_Cr + index_scalar.val[2] * W_Cb +
+                (double)(height - y1) / height;
+            if (upper < cutoff)
+            {
+                __sync_fetch_and_add(&_frame_prunes, 1);
+                index_scalar = cvScalarAll(upper);
+                break;
+            }
+        }
+    }
 
 #endif
 
@@ -22,9 +22,13 @@
 #include <set>
 #include <vector>
 #include <list>
+#include <deque>
 #include <string>
+#include <fstream>
+#include <pthread.h>
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
+#include "dtable.hh"
 
 // default settings for SSIM computation
 #define C1  6.5025
@@ -35,63 +39,300 @@
 
 #define INF 1e9
 
+#define FP_SIZE 8 // fingerprints are taken from FP_SIZE x FP_SIZE luminance thumbnails
+#define PROXY_WIN 4 // proxy scores average the SSIM of PROXY_WIN x PROXY_WIN windows tiling the thumbnails
+
+#ifndef SCORE_STRIPES
+    #define SCORE_STRIPES 8 // a frame score with a cutoff is computed in this many stripes, or batches of samples
+#endif
+
+#ifndef MEMO_SIZE
+    #define MEMO_SIZE (1 << 20) // most frame scores remembered for each pair of videos
+#endif
+
+#ifndef SCORE_TILE
+    #define SCORE_TILE 8 // frame scores computed in parallel are split into tasks of SCORE_TILE x SCORE_TILE frames
+#endif
+
+#ifndef SCORE_BAND
+    #define SCORE_BAND 128 // rows of the bands a full frame score is split into to be computed on several threads
+#endif
+
 #ifndef CACHE_SIZE
     #define CACHE_SIZE 20 // number of frames in cache for each video
 #endif
 
+#define FRAME_ALIGN 64 // bytes, the alignment of the rows of frame buffers
+
+#ifndef CACHE_SHARDS
+    #define CACHE_SHARDS 4 // the frame cache of a video is split into this many shards, each with a lock of its own
+#endif
+
 #define INSERTED_FRAME 0.0 // score for an inserted frame, with 1.0 being best possible score
 #define DELETED_FRAME 0.0 // score for an inserted frame, with 1.0 being best possible score
 
 typedef double score_t;
-typedef uint16_t video_t;
-typedef uint16_t frame_t;
+typedef uint32_t video_t;
+typedef uint32_t frame_t;
+
+// a float image with one plane per channel, for kernels that work on one channel at a time. each row of a plane
+// starts at a FRAME_ALIGN byte boundary. buffers come from a pool shared with the frames evicted from the cache,
+// and may be shared by frames of the same content, going back to the pool when the last of them releases it.
+class FrameBuffer
+{
+public:
+    FrameBuffer() : _width(0), _height(0), _channels(0), _stride(0), _plane(0), _data(NULL), _refs(NULL) { }
+    FrameBuffer(const FrameBuffer&) : _width(0), _height(0), _channels(0), _stride(0), _plane(0), _data(NULL), _refs(NULL) { } // frames are copied before they are loaded, so a copy starts empty
+    ~FrameBuffer() { release(); }
+
+    void create(int width, int height, int channels); // makes planes of this geometry, keeping the buffer if it has it already and shares it with no other
+    void share(const FrameBuffer& other); // takes the buffer of another, which neither may write to any more
+    void release(); // gives up the buffer, back to the pool if no other shares it
+    bool empty() const { return _data == NULL; }
+    size_t bytes() const { return _data == NULL ? 0 : FRAME_ALIGN + _plane * _channels * sizeof(float); } // memory of the buffer, shared or not
+    bool equals(const FrameBuffer& other) const; // whether the pixels are the same, bit for bit
+    float* row(int channel, int y) const { return _data + channel * _plane + y * _stride; }
+    CvMat* rows(int channel, int y0, int y1, CvMat* header) const; // header of rows y0 to y1 of a plane, for opencv functions
+
+    int _width, _height, _channels;
+    size_t _stride; // floats from one row to the next
+    size_t _plane; // floats from one plane to the next
+
+private:
+    FrameBuffer& operator=(const FrameBuffer&);
+
+    float* _data;
+    volatile int* _refs; // buffers sharing the memory, held at its start
+};
 
 struct FrameData
 {
     FrameData();
     ~FrameData();
     bool load(); // load the image, returns true if image is now loaded
+    bool decode(); // read the image file, the first half of load, returns true if it could be read
+    void preprocess(); // convert the image read and compute the statistics of its windows, the second half of load
+    void recycle(const std::string& path); // make this the frame of another image, keeping the buffers for its load
     bool unload(); // unload the image, returns true if image got unloaded
+    bool identical(const FrameData& other) const; // whether both loaded images are the same, bit for bit
+    bool fingerprint(); // compute the thumbnail and hash of the image, returns true if they are available. thread-safe
+#ifdef SAMPLING_SIZE
+    void sum_luminance(); // compute the summed-area tables of the loaded luminance, for bounds on frame scores. thread-safe
+#endif
 
     bool _loaded; // whether this image is loaded yet
+    bool _loading; // whether a thread is loading this image, which other threads wait for
+    volatile int _pins; // handles that keep this image loaded
     frame_t _index; // the frame index number
+    frame_t _run; // index of the first frame of the run of repeated frames this one belongs to
+    bool _repeated; // whether the run has other frames, which are then scored as its first frame
     std::string _path; // the path to the image
-    IplImage *_image; // image object
+    FrameBuffer _image; // the image in YCrCb
+    IplImage *_decoded; // the image as read, until it is preprocessed
 #ifndef SAMPLING_SIZE
-    IplImage *_image_sq, *_mu, *_mu_sq, *_sigma_sq; // other preprocessed computations
+    FrameBuffer _image_sq, _mu, _mu_sq, _sigma_sq; // other preprocessed computations
+#else
+    bool _summed; // whether the summed-area tables are computed yet, for the image loaded
+    std::vector<double> _sum_y, _sum_y_sq; // summed-area tables of the luminance and of its square, a row and column wider than the image
 #endif
-    CvSize _size;
-    int _nChannels, _depth;
+    bool _listed; // whether frames of the same content loaded later may share the buffers of this one
+    bool _fingerprinted; // whether the fingerprint is computed yet
+    uint64_t _hash; // difference hash of the thumbnail, one bit per horizontal gradient
+    uint64_t _content; // hash of every pixel, equal for bit-identical images. computed when fingerprinted
+    uint64_t _image_content; // the same, of the image loaded, by which frames of the same content find each other. set when decoded
+    unsigned char _thumb[FP_SIZE * FP_SIZE]; // luminance thumbnail
+};
+
+// a frame pinned in the frame cache, which does not unload it until every handle to it is gone
+class FrameHandle
+{
+public:
+    FrameHandle() : _frame(NULL) { }
+    explicit FrameHandle(FrameData* frame) : _frame(frame) { } // takes over a pin already made
+    FrameHandle(const FrameHandle& h) : _frame(h._frame) { pin(); }
+    ~FrameHandle() { release(); }
+    FrameHandle& operator=(const FrameHandle& h)
+    {
+        if (h._frame != _frame)
+        {
+            release();
+            _frame = h._frame;
+            pin();
+        }
+        return *this;
+    }
+
+    void release()
+    {
+        if (_frame != NULL)
+            __sync_fetch_and_sub(&_frame->_pins, 1);
+        _frame = NULL;
+    }
+    bool loaded() const { return _frame != NULL && !_frame->_image.empty(); } // whether the image could be loaded
+    FrameData& operator*() const { return *_frame; }
+    FrameData* operator->() const { return _frame; }
+
+private:
+    void pin()
+    {
+        if (_frame != NULL)
+            __sync_fetch_and_add(&_frame->_pins, 1);
+    }
+
+    FrameData* _frame;
+};
+
+// one shard of the frame cache of a video
+struct CacheShard
+{
+    CacheShard();
+    CacheShard(const CacheShard& shard); // the frames, with a lock of its own
+    ~CacheShard();
+
+    std::list<frame_t> _frames; // frames loaded or being loaded, least recently used first
+    pthread_mutex_t _lock;
+    pthread_cond_t _loaded; // signalled when a frame of the shard is loaded
 };
 
 struct VideoData
 {
-    typedef std::vector<FrameData> FrameList;
-    typedef std::list<frame_t> CacheList;
-    FrameList _frames; // sequence of video frames
-    CacheList _cache;
+    VideoData();
+    VideoData(const VideoData& video); // the frames, without the stream, which stays with the original
+    ~VideoData();
+    FrameData& frame(frame_t index) { return _frames[index - _base]; }
+
+    typedef std::deque<FrameData> FrameList; // a deque, so that frames can be appended while others are loaded
+    FrameList _frames; // sequence of video frames, starting at frame _base
+    std::vector<CacheShard> _shards; // frame i is cached in shard i % CACHE_SHARDS, in LRU order
+    frame_t _base; // index of the first frame held, after earlier frames are released while streaming
+    frame_t _cache_size; // most frames loaded at once, CACHE_SIZE unless set
+    std::ifstream* _stream; // frame list being read as it grows, or NULL. owned
+
+private:
+    VideoData& operator=(const VideoData&);
 };
 
+class Scheduler;
+
+struct SearchOptions
+{
+    SearchOptions();
+
+    double _epsilon; // weighted search: the path found costs at most (1 + epsilon) times the optimal path
+    bool _compare; // also run the exact search, to report the weighted search against it
+    double _deadline; // anytime search: wall-clock budget in seconds, 0 for none
+    int _band; // streaming: largest offset between matched frames
+    int _lag; // streaming: frames held before the alignment of a frame is committed
+    bool _stream; // read the frame lists as they grow, e.g. from pipes
+    double _anchors; // segmented search: smallest confidence of an anchor, 0 for a global search
+    int _threads; // segmented search: segments aligned at once
+    bool _lazy; // A* search: score diagonal moves only when they reach the top of the queue
+    bool _proxy; // DP with recovery: align on thumbnail scores, and compute full scores for the matched frames only
+    bool _fast; // try the fast path for videos that need little alignment first
+    bool _quiet; // leave out the lines of each frame, e.g. for comparisons whose reports would interleave
+    double _runs; // collapse runs of frames differing by at most this much, 0 for bit-identical only, -1 for none
+    Scheduler* _scheduler; // frame scores that are known to be needed are computed in parallel on this, or NULL
+};
+
+struct SearchResult
+{
+    SearchResult();
+    void set(score_t sum, score_t lower, uint32_t length, frame_t n1, frame_t n2); // records the path found and derives score bounds
+
+    score_t _sum; // cost of the path found
+    score_t _lower; // proven lower bound on the cost of an optimal path
+    uint32_t _length; // length of the path found
+    score_t _score_lower, _score_upper; // proven bounds on VSSIM* of an optimal path
+    unsigned long _expansions; // nodes expanded or cells computed
+    bool _timed_out; // the deadline expired, so the path found is the best one so far
+};
+
+double wall_time(); // seconds since the epoch
+void convert_ycrcb(const IplImage* bgr, FrameBuffer& ycrcb); // 8-bit BGR to float YCrCb planes in one pass, the values cvCvtColor and cvConvert give
+
 class VQATS;
 
-score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2); // returns the similarity score between two videos
+// returns the similarity score between two videos
+score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                            const SearchOptions& options = SearchOptions(), SearchResult* result = NULL);
+
+// same, but splits the videos at matching scene cuts and aligns the segments in parallel
+score_t compute_segmented_score(VQATS& v, const video_t& video1, const video_t& video2,
+                                const SearchOptions& options, SearchResult* result = NULL);
+
+// same, for videos of the same length that need little alignment. returns false, having found no score,
+// when the alignment may stray too far from the straight diagonal path for it to be quick
+bool compute_fast_score(VQATS& v, const video_t& video1, const video_t& video2,
+                        const SearchOptions& options, score_t& score, SearchResult* result = NULL);
 
 class VQATS
 {
-    friend score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2);
+    friend score_t compute_video_score(VQATS& v, const video_t& video1, const video_t& video2,
+                                       const SearchOptions& options, SearchResult* result);
+    friend score_t compute_segmented_score(VQATS& v, const video_t& video1, const video_t& video2,
+                                           const SearchOptions& options, SearchResult* result);
+    friend bool compute_fast_score(VQATS& v, const video_t& video1, const video_t& video2,
+                                   const SearchOptions& options, score_t& score, SearchResult* result);
+    friend class StreamAligner; // keeps the scores of its band itself, so a stream does not grow the memo
 public:
     typedef std::map<video_t, VideoData> VideoMap;
+    typedef SparseTable<float> ScoreTable; // frame scores of one pair of videos, by frame pair
+    typedef std::map<std::pair<video_t, video_t>, ScoreTable*> ScoreMemo;
 
     VQATS();
     ~VQATS();
 
     video_t load_video(std::string filename); // takes as input an ascii file that has paths to images of the sequence on separate lines
+    video_t add_video(const std::vector<std::string>& paths); // same, but takes the paths themselves
+    video_t open_video(std::string filename); // same, but reads the paths only as frames are asked for, e.g. from a pipe
+    bool stream_frame(const video_t& video_index, const frame_t& frame_index); // returns true if the frame is available, reading more of the list if needed
+    void release_frames(const video_t& video_index, const frame_t& frame_index); // drops all frames before this one
+    frame_t collapse_runs(const video_t& video_index, double tolerance); // marks runs of repeated frames, returns the number of frames that repeat an earlier one
+    void set_cache_size(const video_t& video_index, frame_t frames); // most frames of the video kept loaded, e.g. a reference compared with many videos
+    void set_row_bands(Scheduler* scheduler) { _bands = scheduler; } // full frame scores are split into bands of SCORE_BAND rows computed on this, or NULL
+    frame_t loaded_frames(const video_t& video_index); // number of frames of the video loaded now
+    frame_t memo_frames(const video_t& video_index); // memory of the frame scores memoised against the video as reference, in loaded frames of it
+    void unload_video(const video_t& video_index); // unloads the frames of the video and forgets its frame scores, keeping its frame list and fingerprints
+    void remove_video(const video_t& video_index); // same, and forgets the video, closing the frame list it streams
+    unsigned long frame_scores() const { return _frame_scores; } // number of frame scores computed so far
+    unsigned long frame_bounds() const { return _frame_bounds; } // number of frame score bounds computed so far
+    unsigned long frame_prunes() const { return _frame_prunes; } // number of frame scores given up at their cutoff so far
+    unsigned long memo_lookups() const { return _memo_lookups; } // number of frame scores asked for so far
+    unsigned long memo_hits() const { return _memo_hits; } // number of those found in the memo
+    unsigned long proxy_scores() const { return _proxy_scores; } // number of proxy frame scores computed so far
+    unsigned long identical_scores() const { return _identical_scores; } // number of frame scores of bit-identical frames, taken as 1 without SSIM
+    void reset_counters(unsigned long frame_scores, unsigned long memo_lookups, unsigned long memo_hits); // puts the counters back to values read before, leaving out the searches since
+    void add_counters(unsigned long frame_scores, unsigned long memo_lookups, unsigned long memo_hits,
+                      unsigned long frame_bounds = 0, unsigned long frame_prunes = 0,
+                      unsigned long identical_scores = 0); // counts frame scores asked for of another VQATS or outside of it
+
+    // once the videos are set up, the frames and scores below may be asked for from several threads at once
+    FrameHandle acquire_frame(const video_t& video_index, const frame_t& frame_index); // returns the frame, loaded and pinned in the cache
+    score_t frame_ssim(FrameData& frame1, FrameData& frame2, score_t cutoff = -INF); // the SSIM of two frames loaded by the caller, not counted
+
+    // returns the similarity score between two frames. with a cutoff, the score is computed in stripes and given up
+    // as soon as a bound shows it is under the cutoff, returning that bound instead.
+    score_t compute_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2, score_t cutoff = -INF);
+    score_t bound_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2); // returns an upper bound on it, from the luminance of each frame alone, or 1 in full SSIM builds
+    score_t proxy_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2); // returns an estimate of it, from the luminance thumbnails only
+    // same as compute_frame_score for each of the pairs, computed in parallel tasks on the scheduler
+    void score_pairs(const video_t& video1, const video_t& video2, const std::vector<std::pair<frame_t, frame_t> >& pairs,
+                     std::vector<score_t>& scores, Scheduler& scheduler);
 
 private:
-    score_t compute_frame_score(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2); // returns the similarity score between two frames
-    bool load_video_frame(const video_t& video_index, const frame_t& frame_index); // loads the video frame into cache
+    score_t compute_ssim(const video_t& video1, const video_t& video2, const frame_t& index1, const frame_t& index2, score_t cutoff); // compute_frame_score, without runs or memo
+    ScoreTable* score_table(const video_t& video1, const video_t& video2); // the memo of a pair of videos, created if needed
 
     VideoMap _video_map;
+    ScoreMemo _score_memo; // frame scores computed so far, between the first frames of runs
+    pthread_rwlock_t _memo_lock; // held to read the memo, or exclusively to add to it
     video_t _num_videos;    
+    unsigned long _frame_scores;
+    unsigned long _frame_bounds;
+    unsigned long _frame_prunes;
+    unsigned long _memo_lookups, _memo_hits;
+    unsigned long _proxy_scores;
+    unsigned long _identical_scores;
+    Scheduler* _bands;
 };
 